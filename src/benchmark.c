@@ -1,22 +1,140 @@
+/* Benchmark of the k8055 library.
+
+ usage: k8055-benchmark [-l output:input[,output:input...]] [port]
+
+ By default, the time taken by host-side calls (reads, writes, sequences) is measured.
+ With -l, digital outputs are wired back to digital inputs (channels are zero indexed) and the
+ time from k8055_set_digital() returning until the change is observed in an input packet is
+ measured instead, for every given pair of channels.
+*/
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/time.h>
+#include <pthread.h>
 #include "k8055.h"
 
 
 #define ITERATIONS 1000
+#define LOOPBACK_ITERATIONS 100 /* toggles per output channel */
+#define LOOPBACK_TIMEOUT 1000 /* [ms] time after which a change is considered lost */
 
-int main(int argc, char *argv[]) {
-	int port;
-	if (argc <= 1) port = 0;
-	else port = atoi(argv[1]);
+static bool sampling = true;
+static pthread_mutex_t sampling_lock = PTHREAD_MUTEX_INITIALIZER;
 
-	k8055_device* device;
-	if (k8055_open_device(port, &device) != 0) {
-		printf("could not open board on port %i\n", port);
+static bool is_sampling(void) {
+	pthread_mutex_lock(&sampling_lock);
+	bool r = sampling;
+	pthread_mutex_unlock(&sampling_lock);
+	return r;
+}
+
+/* reads inputs as fast as possible, as a background poller would */
+static void* sample(void* device) {
+	while (is_sampling())
+		k8055_get_all_input((k8055_device*) device, NULL, NULL, NULL, NULL, NULL, false);
+	return NULL;
+}
+
+static int compare_int(const void* a, const void* b) {
+	return *(const int*) a - *(const int*) b;
+}
+
+/* prints the distribution of the given latencies [us], sorting them */
+static void print_distribution(const char* name, int* us, int n) {
+	if (n == 0) {
+		printf("%s: no samples\n", name);
+		return;
+	}
+	qsort(us, n, sizeof(int), compare_int);
+	double sum = 0;
+	for (int i = 0; i < n; ++i)
+		sum += us[i];
+	printf("%s: min %.3f, mean %.3f, median %.3f, 90%% %.3f, 99%% %.3f, max %.3f [ms]\n", name,
+			us[0] / 1000.0, sum / n / 1000, us[n / 2] / 1000.0, us[n * 90 / 100] / 1000.0,
+			us[n * 99 / 100] / 1000.0, us[n - 1] / 1000.0);
+}
+
+/* measures actuation-to-observation latency for the given "output:input,..." mapping */
+static int benchmark_loopback(k8055_device* device, char* map) {
+	int outputs[8];
+	int inputs[8];
+	int pairs = 0;
+	for (char* pair = strtok(map, ","); pair != NULL; pair = strtok(NULL, ",")) {
+		if (pairs == 8 || sscanf(pair, "%d:%d", &outputs[pairs], &inputs[pairs]) != 2
+				|| outputs[pairs] < 0 || outputs[pairs] > 7 || inputs[pairs] < 0 || inputs[pairs] > 4) {
+			printf("invalid loopback mapping '%s', expected output:input with outputs 0-7 and inputs 0-4\n", pair);
+			return -1;
+		}
+		pairs += 1;
+	}
+
+	static int latencies[8 * LOOPBACK_ITERATIONS];
+	int all[8 * LOOPBACK_ITERATIONS];
+	int counts[8] = {0};
+	int lost = 0;
+	int total = 0;
+
+	int state[8]; /* input state last observed for each pair */
+	int bitmask;
+	k8055_set_all_digital(device, 0);
+	if (k8055_get_all_input(device, &bitmask, NULL, NULL, NULL, NULL, false) != 0) {
+		puts("could not read inputs");
 		return -1;
-	};
+	}
+	for (int p = 0; p < pairs; ++p)
+		state[p] = (bitmask >> inputs[p]) & 1;
+
+	for (int i = 0; i < LOOPBACK_ITERATIONS; ++i) {
+		bool value = (i % 2) == 0;
+		for (int p = 0; p < pairs; ++p) {
+			struct timeval t0;
+			struct timeval t;
+			if (k8055_set_digital(device, outputs[p], value) != 0) {
+				lost += 1;
+				continue;
+			}
+			gettimeofday(&t0, NULL);
 
+			int us = 0;
+			do { /* the first input packet reflecting the change */
+				int r = k8055_get_all_input(device, &bitmask, NULL, NULL, NULL, NULL, true);
+				gettimeofday(&t, NULL);
+				us = (t.tv_sec - t0.tv_sec) * 1000000 + t.tv_usec - t0.tv_usec;
+				if (r == 0 && ((bitmask >> inputs[p]) & 1) == value)
+					break;
+			} while (us < LOOPBACK_TIMEOUT * 1000);
+
+			/* a change counts only if the input was seen in the opposite state before */
+			bool changed = state[p] != value;
+			state[p] = (bitmask >> inputs[p]) & 1;
+			if (us >= LOOPBACK_TIMEOUT * 1000 || !changed) {
+				lost += 1;
+				continue;
+			}
+			latencies[p * LOOPBACK_ITERATIONS + counts[p]] = us;
+			counts[p] += 1;
+			all[total++] = us;
+		}
+	}
+	k8055_set_all_digital(device, 0);
+
+	printf("actuation to observation latency, %i toggles per channel\n", LOOPBACK_ITERATIONS);
+	for (int p = 0; p < pairs; ++p) {
+		char name[32];
+		sprintf(name, "output %i -> input %i", outputs[p], inputs[p]);
+		print_distribution(name, &latencies[p * LOOPBACK_ITERATIONS], counts[p]);
+	}
+	print_distribution("all channels", all, total);
+	if (lost > 0)
+		printf("%i changes not observed within %i [ms] or following a missed change\n", lost, LOOPBACK_TIMEOUT);
+	return 0;
+}
+
+/* measures the time taken by host-side calls */
+static void benchmark_calls(k8055_device* device) {
 	struct timeval t0;
 	struct timeval t;
 
@@ -37,4 +155,78 @@ int main(int argc, char *argv[]) {
 		us += (t.tv_sec - t0.tv_sec) * 1000000 + t.tv_usec - t0.tv_usec;
 	}
 	printf("average quick read time for %i iterations: %.3f [ms]\n", ITERATIONS, 1.0 *  us / ITERATIONS / 1000);
+
+	us = 0;
+	for (int i = 0; i < ITERATIONS; ++i) {
+		gettimeofday(&t0, NULL);
+		k8055_set_all_digital(device, i % 256);
+		gettimeofday(&t, NULL);
+		us += (t.tv_sec - t0.tv_sec) * 1000000 + t.tv_usec - t0.tv_usec;
+	}
+	printf("average write time for %i iterations: %.3f [ms]\n", ITERATIONS, 1.0 * us / ITERATIONS / 1000);
+
+	struct k8055_output states[ITERATIONS];
+	for (int i = 0; i < ITERATIONS; ++i) {
+		states[i].digital = i % 256;
+		states[i].analog0 = i % 256;
+		states[i].analog1 = i % 256;
+	}
+	gettimeofday(&t0, NULL);
+	k8055_write_sequence(device, states, ITERATIONS, NULL, 0);
+	gettimeofday(&t, NULL);
+	us = (t.tv_sec - t0.tv_sec) * 1000000 + t.tv_usec - t0.tv_usec;
+	printf("average sequence write time for %i states: %.3f [ms]\n", ITERATIONS, 1.0 * us / ITERATIONS / 1000);
+
+	pthread_t sampler;
+	pthread_create(&sampler, NULL, sample, device);
+	us = 0;
+	int max_us = 0;
+	for (int i = 0; i < ITERATIONS; ++i) {
+		gettimeofday(&t0, NULL);
+		k8055_set_all_digital(device, i % 256);
+		gettimeofday(&t, NULL);
+		int dt = (t.tv_sec - t0.tv_sec) * 1000000 + t.tv_usec - t0.tv_usec;
+		us += dt;
+		if (dt > max_us)
+			max_us = dt;
+	}
+	pthread_mutex_lock(&sampling_lock);
+	sampling = false;
+	pthread_mutex_unlock(&sampling_lock);
+	pthread_join(sampler, NULL);
+	printf("average write time while reading from another thread for %i iterations: %.3f [ms] (maximum %.3f [ms])\n",
+			ITERATIONS, 1.0 * us / ITERATIONS / 1000, max_us / 1000.0);
+
+	k8055_set_all_digital(device, 0);
+}
+
+int main(int argc, char *argv[]) {
+	char* map = NULL;
+	int c;
+	while ((c = getopt(argc, argv, "l:")) != -1) {
+		if (c != 'l') {
+			puts("usage: k8055-benchmark [-l output:input[,output:input...]] [port]");
+			return -1;
+		}
+		map = optarg;
+	}
+
+	int port;
+	if (optind >= argc) port = 0;
+	else port = atoi(argv[optind]);
+
+	k8055_device* device;
+	if (k8055_open_device(port, &device) != 0) {
+		printf("could not open board on port %i\n", port);
+		return -1;
+	};
+
+	int r = 0;
+	if (map != NULL)
+		r = benchmark_loopback(device, map);
+	else
+		benchmark_calls(device);
+
+	k8055_close_device(device);
+	return r;
 }
@@ -102,7 +102,23 @@
 #define WRITE_TRIES 3 /* maximum number of write tries */
 #define READ_TRIES 3/* maximum number of read tries */
 
+#define TRANSFERS 4 /* number of preallocated transfers per device */
+#define DRAIN_TRIES 10 /* rounds of event handling waiting for lost transfers to be cancelled on close */
+#define POLL_MIN_INTERVAL 10 /* [ms] default shortest poll interval, the board's interrupt interval */
+#define POLL_MAX_INTERVAL 1000 /* [ms] default longest poll interval */
+#define POLL_DEADBAND 1 /* default change of an analog input ignored by polls, the converter's jitter */
+#define WINDOWS 4 /* maximum number of aggregation windows per device */
+#define WINDOW_PANES 8 /* maximum number of hops per window length */
+#define PRIORITY_OUTPUT 0 /* priority class of output commands */
+#define PRIORITY_COUNTER 1 /* priority class of counter resets and debounce settings */
+#define PRIORITY_INPUT 2 /* priority class of input reads */
+#define PRIORITIES 3
+#define MAX_BYPASSES 8 /* grants overtaking a waiting lower class before it is served */
+#define TRACE_LENGTH 256 /* number of trace events kept per device */
+#define BUFFERS_LENGTH ((2 + TRANSFERS) * PACKET_LENGTH) /* length of a device's buffers (data_in, data_out and one per transfer) */
+
 #define IN_DIGITAL_OFFSET 0
+#define IN_STATUS_OFFSET 1
 #define IN_ANALOG_0_OFFSET 2
 #define IN_ANALOG_1_OFFSET 3
 #define IN_COUNTER_0_OFFSET 4
@@ -128,20 +144,123 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#include <pthread.h>
 #include <libusb-1.0/libusb.h>
 #include "k8055.h"
 
+/** A libusb transfer, preallocated when a device is opened and recycled for every packet. */
+struct k8055_transfer {
+
+	struct libusb_transfer *transfer;
+
+	/** Packet buffer of the transfer, used for packets that are not in data_in or data_out. */
+	unsigned char *buffer;
+
+	/** Device owning the transfer. */
+	struct k8055_device *device;
+
+	/** Set by k8055_transfer_callback() when the transfer has completed. Written under the owning
+	 * device's lock, as the callback may run in any thread handling libusb events. */
+	int completed;
+
+	/** Time of submission and number of the try, recorded in the trace on completion. */
+	uint64_t submitted;
+	int attempt;
+
+	/** Set if libusb failed to give the transfer back after an error. It may still be in flight and
+	 * is kept out of the free list until it is drained on close, see k8055_drain_transfers(). */
+	bool lost;
+
+	/** Next transfer in the owning device's free list. */
+	struct k8055_transfer *next;
+};
+
+/** Partial aggregate of the inputs read during one hop of a window. */
+struct k8055_pane {
+	uint64_t start; /* [us] */
+	int samples;
+	int analog_min[2];
+	int analog_max[2];
+	uint64_t analog_sum[2];
+	uint64_t analog_sum_squares[2];
+	int counter_delta[2];
+	int digital_on;
+};
+
+/** Aggregation window of a device. A window is made up of its last 'panes' panes, each one hop long,
+ * so that sliding windows are combined from the panes instead of revisiting samples. */
+struct k8055_window_state {
+	int hop; /* [ms] */
+	int panes;
+	struct k8055_pane current;
+	struct k8055_pane completed[WINDOW_PANES]; /* ring buffer of the last completed panes */
+	int completed_count;
+	struct k8055_window last; /* last completed window */
+	bool ready; /* last has not been read yet */
+	int dropped; /* completed windows not returned since the previous read */
+};
+
 /** Represents a Vellemean K8055 USB board. */
 struct k8055_device {
 
 	/** Data last read from device, used by k8055_read_data(). */
-	unsigned char data_in[PACKET_LENGTH];
+	unsigned char *data_in;
 
 	/** Data to be sent to the device, used by k8055_write_data(). */
-	unsigned char data_out[PACKET_LENGTH];
+	unsigned char *data_out;
 
 	unsigned char current_out[PACKET_LENGTH];
 
+	/** Transfers used for all I/O with the device, so that no transfer is allocated per packet. */
+	struct k8055_transfer transfers[TRANSFERS];
+
+	/** Transfers that are not currently submitted. NULL if all transfers are in use. */
+	struct k8055_transfer *free_transfers;
+
+	/** Set when a transfer was lost, after which the device refuses further I/O until it is reopened. */
+	bool failed;
+
+	/** Memory backing data_in, data_out and the transfers' buffers. Allocated with libusb_dev_mem_alloc() where usbfs
+	 * supports zero-copy transfers (dev_mem is set), points to buffer_storage otherwise. */
+	unsigned char *buffers;
+	bool dev_mem;
+	unsigned char buffer_storage[BUFFERS_LENGTH];
+
+	/** Poll interval bounds and current interval [ms], time at which the next poll is due [us],
+	 * analog deadband and input packet the next poll is compared to, used by k8055_poll(). */
+	int poll_min_interval;
+	int poll_max_interval;
+	int poll_interval;
+	uint64_t poll_due;
+	int poll_deadband;
+	unsigned char poll_last[PACKET_LENGTH];
+
+	/** Aggregation windows and the counter values of the previous read, used to compute counter deltas.
+	 * The counter values are tracked even without windows, so that a new window starts from the last read.
+	 * After a counter is reset, the firmware still returns the packet it buffered before the reset, so
+	 * window_reset_reads counts the input packets to read until one sampled after the reset arrives. */
+	struct k8055_window_state windows[WINDOWS];
+	int window_count;
+	int window_counter[2];
+	int window_reset_reads[2];
+
+	/** Ring buffer of trace events. trace_head counts all events recorded, trace_tail
+	 * all events read (or overwritten), so that trace[trace_head % TRACE_LENGTH] is the next slot. */
+	struct k8055_trace_event trace[TRACE_LENGTH];
+	uint32_t trace_head;
+	uint32_t trace_tail;
+	bool trace_enabled;
+
+	/** Request scheduler: a thread must own the device (busy) to access any other field. Threads
+	 * waiting for the device and the grants that overtook them since their class was last served
+	 * are counted per priority class, see k8055_acquire(). */
+	pthread_mutex_t lock;
+	pthread_cond_t released;
+	bool busy;
+	int waiting[PRIORITIES];
+	int bypasses[PRIORITIES];
+
 	/** Underlying libusb handle to device. NULL if the device is not open. */
 	libusb_device_handle *device_handle;
 };
@@ -149,6 +268,7 @@ struct k8055_device {
 /** Libusb context. */
 static libusb_context* context = NULL;
 static int k8055_open_devices = 0;
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER; /* guards context and k8055_open_devices */
 static int debug = 0;
 
 void k8055_debug(bool value) {
@@ -162,7 +282,120 @@ static void print_error(const char * str) {
 	}
 }
 
-int k8055_open_device(int port, k8055_device** device) {
+/** Returns the current time of the monotonic clock [us]. */
+static uint64_t k8055_now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+/** Returns the priority class whose turn it is to own the device, -1 if no thread is waiting.
+ * Must be called with the device's lock held. */
+static int k8055_next_class(k8055_device* device) {
+	int highest = -1;
+	int overtaken = -1; /* most overtaken class that is due */
+	for (int p = 0; p < PRIORITIES; ++p) {
+		if (device->waiting[p] > 0) {
+			if (highest < 0)
+				highest = p;
+			if (device->bypasses[p] >= MAX_BYPASSES
+					&& (overtaken < 0 || device->bypasses[p] > device->bypasses[overtaken]))
+				overtaken = p;
+		}
+	}
+	if (overtaken >= 0) /* don't starve lower classes */
+		return overtaken;
+	return highest;
+}
+
+/** Waits until the device is free and it is the turn of the given priority class, then takes ownership of the device.
+ * Waiting threads of higher classes are served first, but a waiting lower class is served once it has been
+ * overtaken MAX_BYPASSES times. If several are due, the one overtaken most often goes first. */
+static void k8055_acquire(k8055_device* device, int priority) {
+	pthread_mutex_lock(&device->lock);
+	device->waiting[priority] += 1;
+	while (device->busy || k8055_next_class(device) != priority)
+		pthread_cond_wait(&device->released, &device->lock);
+	device->waiting[priority] -= 1;
+	device->busy = true;
+
+	device->bypasses[priority] = 0;
+	for (int p = priority + 1; p < PRIORITIES; ++p)
+		if (device->waiting[p] > 0)
+			device->bypasses[p] += 1;
+	pthread_mutex_unlock(&device->lock);
+}
+
+static void k8055_release(k8055_device* device) {
+	pthread_mutex_lock(&device->lock);
+	device->busy = false;
+	pthread_cond_broadcast(&device->released);
+	pthread_mutex_unlock(&device->lock);
+}
+
+/** Hands the device over to waiting threads of higher priority classes, if any, between two transfers of a longer operation. */
+static void k8055_yield(k8055_device* device, int priority) {
+	bool higher = false;
+	pthread_mutex_lock(&device->lock);
+	for (int p = 0; p < priority; ++p)
+		if (device->waiting[p] > 0)
+			higher = true;
+	pthread_mutex_unlock(&device->lock);
+	if (higher) {
+		k8055_release(device);
+		k8055_acquire(device, priority);
+	}
+}
+
+/** Allocates the transfers and buffers of a device whose handle has been opened.
+ * Buffers are allocated in DMA-capable memory if the platform supports it.
+ * @return 0 on success
+ * @return K8055_ERROR_MEM if a transfer could not be allocated, in which case
+ * k8055_free_transfers() must still be called */
+static int k8055_alloc_transfers(k8055_device* device) {
+	device->buffers = NULL;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	device->buffers = libusb_dev_mem_alloc(device->device_handle, BUFFERS_LENGTH);
+#endif
+	device->dev_mem = (device->buffers != NULL);
+	if (!device->dev_mem)
+		device->buffers = device->buffer_storage;
+	device->data_in = device->buffers;
+	device->data_out = device->buffers + PACKET_LENGTH;
+
+	device->free_transfers = NULL;
+	device->failed = false;
+	for (int i = 0; i < TRANSFERS; ++i)
+		device->transfers[i].transfer = NULL;
+	for (int i = 0; i < TRANSFERS; ++i) {
+		device->transfers[i].transfer = libusb_alloc_transfer(0);
+		if (device->transfers[i].transfer == NULL)
+			return K8055_ERROR_MEM;
+		device->transfers[i].buffer = device->buffers + (2 + i) * PACKET_LENGTH;
+		device->transfers[i].device = device;
+		device->transfers[i].lost = false;
+		device->transfers[i].next = device->free_transfers;
+		device->free_transfers = &device->transfers[i];
+	}
+	return 0;
+}
+
+static bool k8055_drain_transfers(k8055_device* device);
+
+/** Frees the transfers and buffers of a device, before its handle is closed. Lost transfers must have
+ * been drained with k8055_drain_transfers() first. */
+static void k8055_free_transfers(k8055_device* device) {
+	for (int i = 0; i < TRANSFERS; ++i)
+		libusb_free_transfer(device->transfers[i].transfer);
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	if (device->dev_mem)
+		libusb_dev_mem_free(device->device_handle, device->buffers, BUFFERS_LENGTH);
+#endif
+	device->dev_mem = false;
+}
+
+/** Opens a device, see k8055_open_device(). Must be called with open_lock held. */
+static int k8055_open(int port, k8055_device** device) {
 	if (port < 0 || K8055_MAX_DEVICES <= port) {
 		print_error("invalid port number, port p should be 0<=p<=3");
 		return K8055_ERROR_INDEX;
@@ -239,9 +472,44 @@ int k8055_open_device(int port, k8055_device** device) {
 	
 	_device->device_handle = handle; /* add usb handle */
 	
+	pthread_mutex_init(&_device->lock, NULL);
+	pthread_cond_init(&_device->released, NULL);
+	_device->busy = false;
+	for (int p = 0; p < PRIORITIES; ++p) {
+		_device->waiting[p] = 0;
+		_device->bypasses[p] = 0;
+	}
+	
+	if (k8055_alloc_transfers(_device) != 0) {
+		print_error("could not allocate transfers for device");
+		k8055_free_transfers(_device);
+		libusb_release_interface(handle, 0);
+		libusb_close(handle);
+		pthread_cond_destroy(&_device->released);
+		pthread_mutex_destroy(&_device->lock);
+		free(_device);
+		return K8055_ERROR_MEM;
+	}
+	
+	_device->trace_head = 0;
+	_device->trace_tail = 0;
+	_device->trace_enabled = true;
+	
+	_device->poll_min_interval = POLL_MIN_INTERVAL;
+	_device->poll_max_interval = POLL_MAX_INTERVAL;
+	_device->poll_interval = POLL_MIN_INTERVAL;
+	_device->poll_due = 0;
+	_device->poll_deadband = POLL_DEADBAND;
+	_device->window_count = 0;
+	_device->window_counter[0] = 0;
+	_device->window_counter[1] = 0;
+	_device->window_reset_reads[0] = 0;
+	_device->window_reset_reads[1] = 0;
+	
 	for (int i = 0; i < PACKET_LENGTH; ++i) { /* initialize command data */
 		_device->data_out[i]=0;
 		_device->current_out[i]=0;
+		_device->poll_last[i]=0;
 	}
 	
 	k8055_set_all_digital(_device, 0);
@@ -257,10 +525,28 @@ int k8055_open_device(int port, k8055_device** device) {
 	return 0;
 }
 
+int k8055_open_device(int port, k8055_device** device) {
+	pthread_mutex_lock(&open_lock);
+	int r = k8055_open(port, device);
+	pthread_mutex_unlock(&open_lock);
+	return r;
+}
+
 void k8055_close_device(k8055_device* device) {
+	pthread_mutex_lock(&open_lock);
+	if (!k8055_drain_transfers(device)) {
+		/* libusb may still complete a transfer into the device's memory: leak the device
+		 * rather than free it, and keep it counted so that the context stays alive */
+		print_error("could not cancel lost transfers, device not freed");
+		pthread_mutex_unlock(&open_lock);
+		return;
+	}
+	k8055_free_transfers(device);
 	libusb_release_interface(device->device_handle, 0);
 	libusb_close(device->device_handle);
 	device->device_handle = NULL;
+	pthread_cond_destroy(&device->released);
+	pthread_mutex_destroy(&device->lock);
 	free(device);
 	device = NULL;
 
@@ -268,6 +554,162 @@ void k8055_close_device(k8055_device* device) {
 
 	if (k8055_open_devices <= 0)
 		libusb_exit(context);
+	pthread_mutex_unlock(&open_lock);
+}
+
+void k8055_trace(k8055_device* device, bool enable) {
+	k8055_acquire(device, PRIORITY_OUTPUT);
+	device->trace_enabled = enable;
+	k8055_release(device);
+}
+
+int k8055_read_trace(k8055_device* device, struct k8055_trace_event* events, int length) {
+	k8055_acquire(device, PRIORITY_OUTPUT);
+	int n = 0;
+	for (; n < length && device->trace_tail != device->trace_head; ++n) {
+		events[n] = device->trace[device->trace_tail % TRACE_LENGTH];
+		device->trace_tail += 1;
+	}
+	k8055_release(device);
+	return n;
+}
+
+/** Records a trace event for a transfer of the given device.
+ * @param status 0 if the transfer succeeded, libusb error code otherwise */
+static void k8055_trace_record(k8055_device* device, struct k8055_transfer *t, int status) {
+	struct k8055_trace_event *event = &device->trace[device->trace_head % TRACE_LENGTH];
+	event->time = t->submitted;
+	event->latency = (uint32_t) (k8055_now() - t->submitted);
+	event->sequence = device->trace_head;
+	event->status = status;
+	if (t->transfer->endpoint == USB_OUT_EP) {
+		event->type = K8055_TRACE_WRITE;
+		event->command = t->transfer->buffer[OUT_CMD_OFFEST];
+	} else {
+		event->type = K8055_TRACE_READ;
+		event->command = 0;
+	}
+	event->attempt = t->attempt;
+	event->length = status == 0 ? t->transfer->actual_length : 0;
+
+	device->trace_head += 1;
+	if (device->trace_head - device->trace_tail > TRACE_LENGTH) /* overwrote the oldest event */
+		device->trace_tail = device->trace_head - TRACE_LENGTH;
+}
+
+/** Converts the status of a completed transfer to a libusb error code. */
+static int k8055_transfer_status(struct libusb_transfer *transfer) {
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+/** Called by libusb in whichever thread is handling events, which is not necessarily the thread
+ * owning the device, so the trace and the completed flag are only written with the device's lock held. */
+static void LIBUSB_CALL k8055_transfer_callback(struct libusb_transfer *transfer) {
+	struct k8055_transfer *t = (struct k8055_transfer *) transfer->user_data;
+	pthread_mutex_lock(&t->device->lock);
+	if (t->device->trace_enabled)
+		k8055_trace_record(t->device, t, k8055_transfer_status(transfer));
+	t->completed = 1;
+	pthread_mutex_unlock(&t->device->lock);
+}
+
+/** Returns whether the given transfer has completed, see k8055_transfer_callback(). */
+static bool k8055_completed(struct k8055_transfer *t) {
+	pthread_mutex_lock(&t->device->lock);
+	bool completed = t->completed != 0;
+	pthread_mutex_unlock(&t->device->lock);
+	return completed;
+}
+
+/** Marks a transfer that libusb failed to give back as lost, see k8055_transfer.lost. */
+static void k8055_lose_transfer(k8055_device* device, struct k8055_transfer *t) {
+	t->lost = true;
+	device->failed = true;
+	print_error("transfer lost, device must be reopened");
+}
+
+/** Cancels the device's lost transfers and handles events until they are given back, or at most DRAIN_TRIES times.
+ * @return true if no transfer is in flight anymore */
+static bool k8055_drain_transfers(k8055_device* device) {
+	bool drained = true;
+	for (int i = 0; i < TRANSFERS; ++i) {
+		struct k8055_transfer *t = &device->transfers[i];
+		if (!t->lost)
+			continue;
+		libusb_cancel_transfer(t->transfer);
+		for (int j = 0; j < DRAIN_TRIES && !k8055_completed(t); ++j)
+			libusb_handle_events_completed(context, &t->completed);
+		if (k8055_completed(t))
+			t->lost = false;
+		else
+			drained = false;
+	}
+	return drained;
+}
+
+/** Submits a transfer, recording its submission time if tracing is enabled.
+ * @return 0 on success or a libusb error code */
+static int k8055_submit_transfer(k8055_device* device, struct k8055_transfer *t, int attempt) {
+	t->completed = 0;
+	t->attempt = attempt;
+	if (device->trace_enabled)
+		t->submitted = k8055_now();
+	int r = libusb_submit_transfer(t->transfer);
+	if (r != 0 && device->trace_enabled) {
+		pthread_mutex_lock(&device->lock); /* other transfers of the device may be completing */
+		k8055_trace_record(device, t, r);
+		pthread_mutex_unlock(&device->lock);
+	}
+	return r;
+}
+
+/** Blocking interrupt transfer of one packet, equivalent to libusb_interrupt_transfer() except
+ * that it uses one of the device's preallocated transfers instead of allocating a new one.
+ * @return 0 on success or a libusb error code */
+static int k8055_interrupt_transfer(k8055_device* device, unsigned char endpoint,
+		unsigned char *data, int *transferred, int attempt) {
+	struct k8055_transfer *t = device->free_transfers;
+	if (t == NULL)
+		return LIBUSB_ERROR_BUSY;
+	device->free_transfers = t->next;
+
+	libusb_fill_interrupt_transfer(t->transfer, device->device_handle, endpoint, data,
+			PACKET_LENGTH, k8055_transfer_callback, t, USB_TIMEOUT);
+	int r = k8055_submit_transfer(device, t, attempt);
+	if (r == 0) {
+		while (!k8055_completed(t)) {
+			r = libusb_handle_events_completed(context, &t->completed);
+			if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) { /* cancel and wait for the transfer to be given back */
+				libusb_cancel_transfer(t->transfer);
+				while (!k8055_completed(t))
+					if (libusb_handle_events_completed(context, &t->completed) < 0) {
+						k8055_lose_transfer(device, t); /* keep it out of the free list */
+						return r;
+					}
+				break;
+			}
+		}
+		if (r == 0 || r == LIBUSB_ERROR_INTERRUPTED)
+			r = k8055_transfer_status(t->transfer);
+		*transferred = t->transfer->actual_length;
+	}
+
+	t->next = device->free_transfers;
+	device->free_transfers = t;
+	return r;
 }
 
 /** Writes the actual data contained in the device's data_out field to the usb endpoint.
@@ -280,15 +722,20 @@ static int k8055_write_data(k8055_device* device) {
 		print_error("unable to write data, device not open");
 		return K8055_ERROR_CLOSED;
 	}
+	if (device->failed) {
+		print_error("unable to write data, device must be reopened");
+		return K8055_ERROR_CLOSED;
+	}
 
 	int transferred = 0;
-	for (int i = 0; i < WRITE_TRIES; ++i) { /* number of tries on failure */
-		write_status = libusb_interrupt_transfer(device->device_handle,
-				USB_OUT_EP, (unsigned char *) device->data_out, PACKET_LENGTH,
-				&transferred, USB_TIMEOUT);
+	for (int i = 0; i < WRITE_TRIES && !device->failed; ++i) { /* number of tries on failure */
+		write_status = k8055_interrupt_transfer(device, USB_OUT_EP,
+				device->data_out, &transferred, i);
 		if (write_status == 0 && transferred == PACKET_LENGTH)
 			break;
 	}
+	if (device->failed)
+		return K8055_ERROR_CLOSED;
 	if (write_status != 0 || transferred != PACKET_LENGTH) {
 		print_error("could not write packet");
 		return K8055_ERROR_WRITE;
@@ -302,6 +749,123 @@ static int k8055_write_data(k8055_device* device) {
 	return 0;
 }
 
+/** Transfer of k8055_write_states() in flight, with the index of the state it writes. */
+struct k8055_sequence_packet {
+	struct k8055_transfer *t;
+	int index;
+};
+
+static int k8055_write_states(k8055_device* device, const struct k8055_output* states, int n,
+		int* status, int flags) {
+	if (device->device_handle == NULL || device->failed) {
+		if (device->failed)
+			print_error("unable to write data, device must be reopened");
+		else
+			print_error("unable to write data, device not open");
+		for (int i = 0; i < n && status != NULL; ++i)
+			status[i] = K8055_ERROR_CLOSED;
+		return K8055_ERROR_CLOSED;
+	}
+
+	struct k8055_sequence_packet in_flight[TRANSFERS]; /* in order of submission */
+	int pending = 0;
+	int next = 0;
+	int result = 0;
+	bool stop = false;
+	bool cancelled = false;
+
+	while ((next < n && !stop) || pending > 0) {
+		while (next < n && !stop && device->free_transfers != NULL) { /* fill the pipeline */
+			struct k8055_transfer *t = device->free_transfers;
+			device->free_transfers = t->next;
+
+			memcpy(t->buffer, device->data_out, PACKET_LENGTH);
+			t->buffer[OUT_CMD_OFFEST] = CMD_SET_ANALOG_DIGITAL;
+			t->buffer[OUT_DIGITAL_OFFSET] = states[next].digital;
+			t->buffer[OUT_ANALOG_0_OFFSET] = states[next].analog0;
+			t->buffer[OUT_ANALOG_1_OFFSET] = states[next].analog1;
+			libusb_fill_interrupt_transfer(t->transfer, device->device_handle, USB_OUT_EP,
+					t->buffer, PACKET_LENGTH, k8055_transfer_callback, t,
+					USB_TIMEOUT * (pending + 1)); /* queued behind the packets in flight */
+
+			if (k8055_submit_transfer(device, t, 0) != 0) {
+				t->next = device->free_transfers;
+				device->free_transfers = t;
+				if (status != NULL)
+					status[next] = K8055_ERROR_WRITE;
+				result = K8055_ERROR_WRITE;
+				stop = (flags & K8055_SEQUENCE_STOP_ON_ERROR) != 0;
+			} else {
+				in_flight[pending].t = t;
+				in_flight[pending].index = next;
+				pending += 1;
+			}
+			next += 1;
+		}
+		if (pending == 0)
+			continue;
+
+		int r = libusb_handle_events_completed(context, &in_flight[0].t->completed);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+			if (cancelled) { /* the transfers in flight are lost, keep them out of the free list */
+				for (int i = 0; i < pending; ++i) {
+					k8055_lose_transfer(device, in_flight[i].t);
+					if (status != NULL)
+						status[in_flight[i].index] = K8055_ERROR_WRITE;
+				}
+				for (int i = next; i < n && status != NULL; ++i)
+					status[i] = K8055_ERROR_WRITE;
+				print_error("could not write packet sequence");
+				return K8055_ERROR_CLOSED;
+			}
+			for (int i = 0; i < pending; ++i)
+				libusb_cancel_transfer(in_flight[i].t->transfer);
+			cancelled = true;
+			stop = true;
+		}
+
+		/* complete packets in order, so that current_out follows the sequence */
+		int done = 0;
+		for (; done < pending && k8055_completed(in_flight[done].t); ++done) {
+			struct k8055_transfer *t = in_flight[done].t;
+			int ok = k8055_transfer_status(t->transfer) == 0
+					&& t->transfer->actual_length == PACKET_LENGTH;
+			if (ok) {
+				memcpy(device->current_out, t->buffer, PACKET_LENGTH);
+			} else {
+				result = K8055_ERROR_WRITE;
+				if (flags & K8055_SEQUENCE_STOP_ON_ERROR)
+					stop = true;
+			}
+			if (status != NULL)
+				status[in_flight[done].index] = ok ? 0 : K8055_ERROR_WRITE;
+			t->next = device->free_transfers;
+			device->free_transfers = t;
+		}
+		pending -= done;
+		memmove(in_flight, in_flight + done, pending * sizeof(in_flight[0]));
+	}
+
+	for (int i = next; i < n && status != NULL; ++i) /* not written after a failure */
+		status[i] = K8055_ERROR_WRITE;
+	if (result != 0)
+		print_error("could not write packet sequence");
+
+	/* further writes start from the state last written */
+	device->data_out[OUT_DIGITAL_OFFSET] = device->current_out[OUT_DIGITAL_OFFSET];
+	device->data_out[OUT_ANALOG_0_OFFSET] = device->current_out[OUT_ANALOG_0_OFFSET];
+	device->data_out[OUT_ANALOG_1_OFFSET] = device->current_out[OUT_ANALOG_1_OFFSET];
+	return result;
+}
+
+int k8055_write_sequence(k8055_device* device, const struct k8055_output* states, int n,
+		int* status, int flags) {
+	k8055_acquire(device, PRIORITY_OUTPUT);
+	int r = k8055_write_states(device, states, n, status, flags);
+	k8055_release(device);
+	return r;
+}
+
 /** Reads data from the usb endpoint into the device's data_in field.
  * @return K8055_ERROR_CLOSED if the board is not open
  * @return K8055_ERROR_READ if another error occurred during the read process */
@@ -312,17 +876,29 @@ static int k8055_read_data(k8055_device* device, int cycles) {
 		print_error("unable to read data, device not open");
 		return K8055_ERROR_CLOSED;
 	}
+	if (device->failed) {
+		print_error("unable to read data, device must be reopened");
+		return K8055_ERROR_CLOSED;
+	}
 
 	int transferred = 0;
-	for (int i = 0; i < READ_TRIES; ++i) { /* number of tries on failure */
+	for (int i = 0; i < READ_TRIES && !device->failed; ++i) { /* number of tries on failure */
 		for (int j = 0; j < cycles; ++j) { /* read at least twice to get fresh data, (i.e. circumvent some kind of buffer) */
-			read_status = libusb_interrupt_transfer(device->device_handle,
-					USB_IN_EP, (unsigned char *) device->data_in, PACKET_LENGTH,
-					&transferred, USB_TIMEOUT);
+			if (i > 0 || j > 0) /* let output commands through between packets */
+				k8055_yield(device, PRIORITY_INPUT);
+			read_status = k8055_interrupt_transfer(device, USB_IN_EP,
+					device->data_in, &transferred, i);
+			if (read_status != 0 || transferred != PACKET_LENGTH)
+				break; /* a failed cycle leaves the buffered packet in place, start over */
+			for (int c = 0; c < 2; ++c)
+				if (device->window_reset_reads[c] > 0)
+					device->window_reset_reads[c] -= 1;
 		}
 		if (read_status == 0 && transferred == PACKET_LENGTH)
 			break;
 	}
+	if (device->failed)
+		return K8055_ERROR_CLOSED;
 	if (read_status != 0 || transferred != PACKET_LENGTH) {
 		print_error("could not read packet");
 		return K8055_ERROR_READ;
@@ -356,12 +932,16 @@ static int k8055_char_to_ms(unsigned char c) {
 }
 
 int k8055_set_all_digital(k8055_device* device, int bitmask) {
+	k8055_acquire(device, PRIORITY_OUTPUT);
 	device->data_out[OUT_DIGITAL_OFFSET] = bitmask;
 	device->data_out[OUT_CMD_OFFEST] = CMD_SET_ANALOG_DIGITAL;
-	return k8055_write_data(device);
+	int r = k8055_write_data(device);
+	k8055_release(device);
+	return r;
 }
 
 int k8055_set_digital(k8055_device* device, int channel, bool value) {
+	k8055_acquire(device, PRIORITY_OUTPUT);
 
 	unsigned char data = device->data_out[OUT_DIGITAL_OFFSET];
 	if (value == false) /* off */
@@ -372,74 +952,91 @@ int k8055_set_digital(k8055_device* device, int channel, bool value) {
 
 	device->data_out[OUT_DIGITAL_OFFSET] = data;
 	device->data_out[OUT_CMD_OFFEST] = CMD_SET_ANALOG_DIGITAL;
-	return k8055_write_data(device);
+	int r = k8055_write_data(device);
+	k8055_release(device);
+	return r;
 }
 
 int k8055_set_all_analog(k8055_device* device, int analog0, int analog1) {
+	k8055_acquire(device, PRIORITY_OUTPUT);
 	device->data_out[OUT_ANALOG_0_OFFSET] = analog0;
 	device->data_out[OUT_ANALOG_1_OFFSET] = analog1;
 	device->data_out[OUT_CMD_OFFEST] = CMD_SET_ANALOG_DIGITAL;
-	return k8055_write_data(device);
+	int r = k8055_write_data(device);
+	k8055_release(device);
+	return r;
 }
 
 int k8055_set_analog(k8055_device* device, int channel, int value) {
 
-	if (channel == 0) {
-		device->data_out[OUT_ANALOG_0_OFFSET] = value;
-	} else if (channel == 1) {
-		device->data_out[OUT_ANALOG_1_OFFSET] = value;
-	} else {
+	if (channel != 0 && channel != 1) {
 		print_error("can't write to unknown analog port");
 		return K8055_ERROR_INDEX;
 	}
 
+	k8055_acquire(device, PRIORITY_OUTPUT);
+	if (channel == 0)
+		device->data_out[OUT_ANALOG_0_OFFSET] = value;
+	else
+		device->data_out[OUT_ANALOG_1_OFFSET] = value;
+
 	device->data_out[OUT_CMD_OFFEST] = CMD_SET_ANALOG_DIGITAL;
-	return k8055_write_data(device);
+	int r = k8055_write_data(device);
+	k8055_release(device);
+	return r;
 }
 
 int k8055_reset_counter(k8055_device* device, int counter) {
 
+	if (counter != 0 && counter != 1) {
+		print_error("can't reset unknown counter");
+		return K8055_ERROR_INDEX;
+	}
+
+	k8055_acquire(device, PRIORITY_COUNTER);
 	if (counter == 0) {
 		device->data_out[OUT_COUNTER_0_OFFSET] = 0;
 		device->data_out[OUT_CMD_OFFEST] = CMD_RESET_COUNTER_0;
-	} else if (counter == 1) {
+	} else {
 		device->data_out[OUT_COUNTER_1_OFFSET] = 0;
 		device->data_out[OUT_CMD_OFFEST] = CMD_RESET_COUNTER_1;
-	} else {
-		print_error("can't reset unknown counter");
-		return K8055_ERROR_INDEX;
 	}
 
-	return k8055_write_data(device);
+	int r = k8055_write_data(device);
+	if (r == 0) { /* counts up to the reset are lost, aggregate from zero once the counter reads fresh */
+		device->window_counter[counter] = 0;
+		device->window_reset_reads[counter] = 2;
+	}
+	k8055_release(device);
+	return r;
 }
 
 int k8055_set_debounce_time(k8055_device* device, int counter, int debounce) {
 
+	if (counter != 0 && counter != 1) {
+		print_error("can't set debounce time for unknown counter");
+		return K8055_ERROR_INDEX;
+	}
+
+	k8055_acquire(device, PRIORITY_COUNTER);
 	if (counter == 0) {
 		device->data_out[OUT_COUNTER_0_DEBOUNCE_OFFSET] = k8055_ms_to_char(
 				debounce);
 		device->data_out[OUT_CMD_OFFEST] = CMD_SET_DEBOUNCE_1;
-	} else if (counter == 1) {
+	} else {
 		device->data_out[OUT_COUNTER_1_DEBOUNCE_OFFSET] = k8055_ms_to_char(
 				debounce);
 		device->data_out[OUT_CMD_OFFEST] = CMD_SET_DEBOUNCE_2;
-	} else {
-		print_error("can't set debounce time for unknown counter");
-		return K8055_ERROR_INDEX;
 	}
 
-	return k8055_write_data(device);
+	int r = k8055_write_data(device);
+	k8055_release(device);
+	return r;
 }
 
-int k8055_get_all_input(k8055_device* device, int *bitmask, int *analog0,
-		int *analog1, int *counter0, int *counter1, bool quick) {
-	int cycles = 2;
-	if (quick)
-		cycles = 1;
-	int r = k8055_read_data(device, cycles);
-	if (r != 0)
-		return r;
-
+/** Decodes the input packet last read from the device into the passed parameters. NULL is a valid parameter. */
+static void k8055_decode_input(k8055_device* device, int *bitmask, int *analog0,
+		int *analog1, int *counter0, int *counter1) {
 	if (bitmask != NULL)
 		*bitmask = (((device->data_in[IN_DIGITAL_OFFSET] >> 4) & 0x03) | /* Input 1 and 2 */
 				((device->data_in[IN_DIGITAL_OFFSET] << 2) & 0x04) | /* Input 3 */
@@ -454,11 +1051,265 @@ int k8055_get_all_input(k8055_device* device, int *bitmask, int *analog0,
 	if (counter1 != NULL)
 		*counter1 = (int) device->data_in[IN_COUNTER_1_OFFSET + 1] << 8
 		| device->data_in[IN_COUNTER_1_OFFSET];
+}
+
+static void k8055_reset_pane(struct k8055_pane* pane, uint64_t start) {
+	pane->start = start;
+	pane->samples = 0;
+	for (int i = 0; i < 2; ++i) {
+		pane->analog_min[i] = 255;
+		pane->analog_max[i] = 0;
+		pane->analog_sum[i] = 0;
+		pane->analog_sum_squares[i] = 0;
+		pane->counter_delta[i] = 0;
+	}
+	pane->digital_on = 0;
+}
+
+/** Completes the current pane of a window and, if enough panes are complete, combines the last ones into a window. */
+static void k8055_complete_pane(struct k8055_window_state* w) {
+	w->completed[w->completed_count % WINDOW_PANES] = w->current;
+	w->completed_count += 1;
+	k8055_reset_pane(&w->current, w->current.start + (uint64_t) w->hop * 1000);
+	if (w->completed_count < w->panes)
+		return;
+
+	struct k8055_window window;
+	struct k8055_window* a = &window;
+	uint64_t sum[2] = {0, 0};
+	uint64_t sum_squares[2] = {0, 0};
+	a->samples = 0;
+	a->digital_on = 0;
+	for (int i = 0; i < 2; ++i) {
+		a->analog_min[i] = 255;
+		a->analog_max[i] = 0;
+		a->counter_delta[i] = 0;
+	}
+	for (int p = w->completed_count - w->panes; p < w->completed_count; ++p) {
+		struct k8055_pane* pane = &w->completed[p % WINDOW_PANES];
+		if (p == w->completed_count - w->panes)
+			a->start = pane->start;
+		a->samples += pane->samples;
+		a->digital_on |= pane->digital_on;
+		for (int i = 0; i < 2; ++i) {
+			if (pane->analog_min[i] < a->analog_min[i])
+				a->analog_min[i] = pane->analog_min[i];
+			if (pane->analog_max[i] > a->analog_max[i])
+				a->analog_max[i] = pane->analog_max[i];
+			sum[i] += pane->analog_sum[i];
+			sum_squares[i] += pane->analog_sum_squares[i];
+			a->counter_delta[i] += pane->counter_delta[i];
+		}
+	}
+	for (int i = 0; i < 2; ++i) {
+		if (a->samples == 0) { /* nothing read during the window */
+			a->analog_min[i] = 0;
+			a->analog_max[i] = 0;
+			a->analog_mean[i] = 0;
+			a->analog_stddev[i] = 0;
+			continue;
+		}
+		a->analog_mean[i] = (double) sum[i] / a->samples;
+		double variance = (double) sum_squares[i] / a->samples - a->analog_mean[i] * a->analog_mean[i];
+		a->analog_stddev[i] = variance > 0 ? sqrt(variance) : 0;
+	}
+
+	/* after a gap in the reads, the windows completed with the window holding the last samples
+	 * are empty: keep the unread window with samples instead */
+	if (w->ready && a->samples == 0 && w->last.samples > 0) {
+		w->dropped += 1;
+		return;
+	}
+	if (w->ready)
+		w->dropped += 1;
+	w->last = window;
+	w->ready = true;
+}
+
+/** Adds the input packet last read from the device to all of its aggregation windows. */
+static void k8055_aggregate(k8055_device* device) {
+	int digital, analog[2], counter[2];
+	k8055_decode_input(device, &digital, &analog[0], &analog[1], &counter[0], &counter[1]);
+	int delta[2];
+	for (int i = 0; i < 2; ++i) { /* counters are 16 bits wide and wrap around */
+		if (device->window_reset_reads[i] > 0) { /* sampled before the reset */
+			delta[i] = 0;
+			continue;
+		}
+		delta[i] = (counter[i] - device->window_counter[i]) & 0xffff;
+		device->window_counter[i] = counter[i];
+	}
+
+	uint64_t now = k8055_now();
+	for (int j = 0; j < device->window_count; ++j) {
+		struct k8055_window_state* w = &device->windows[j];
+		uint64_t hop = (uint64_t) w->hop * 1000;
+		if (now >= w->current.start + hop) {
+			k8055_complete_pane(w);
+			if (now >= w->current.start + hop * w->panes) /* no reads for a whole window, skip older empty panes */
+				w->current.start = now - (now - w->current.start) % hop - hop * w->panes;
+			while (now >= w->current.start + hop)
+				k8055_complete_pane(w);
+		}
+
+		struct k8055_pane* pane = &w->current;
+		pane->samples += 1;
+		pane->digital_on |= digital;
+		for (int i = 0; i < 2; ++i) {
+			if (analog[i] < pane->analog_min[i])
+				pane->analog_min[i] = analog[i];
+			if (analog[i] > pane->analog_max[i])
+				pane->analog_max[i] = analog[i];
+			pane->analog_sum[i] += analog[i];
+			pane->analog_sum_squares[i] += analog[i] * analog[i];
+			pane->counter_delta[i] += delta[i];
+		}
+	}
+}
+
+int k8055_add_window(k8055_device* device, int length, int hop) {
+	if (hop < 1 || length % hop != 0 || length / hop < 1 || length / hop > WINDOW_PANES) {
+		print_error("invalid aggregation window length or hop");
+		return K8055_ERROR_INDEX;
+	}
+
+	k8055_acquire(device, PRIORITY_OUTPUT);
+	if (device->window_count == WINDOWS) {
+		k8055_release(device);
+		print_error("no aggregation window left");
+		return K8055_ERROR_INDEX;
+	}
+	struct k8055_window_state* w = &device->windows[device->window_count];
+	w->hop = hop;
+	w->panes = length / hop;
+	w->completed_count = 0;
+	w->ready = false;
+	w->dropped = 0;
+	k8055_reset_pane(&w->current, k8055_now());
+	int window = device->window_count++;
+	k8055_release(device);
+	return window;
+}
+
+int k8055_read_window(k8055_device* device, int window, struct k8055_window* aggregate) {
+	k8055_acquire(device, PRIORITY_OUTPUT);
+	if (window < 0 || window >= device->window_count) {
+		k8055_release(device);
+		print_error("unknown aggregation window");
+		return K8055_ERROR_INDEX;
+	}
+	struct k8055_window_state* w = &device->windows[window];
+	int r = 0;
+	if (w->ready) {
+		*aggregate = w->last;
+		aggregate->dropped = w->dropped;
+		w->ready = false;
+		w->dropped = 0;
+		r = 1;
+	}
+	k8055_release(device);
+	return r;
+}
+
+int k8055_get_all_input(k8055_device* device, int *bitmask, int *analog0,
+		int *analog1, int *counter0, int *counter1, bool quick) {
+	int cycles = 2;
+	if (quick)
+		cycles = 1;
+	k8055_acquire(device, PRIORITY_INPUT);
+	int r = k8055_read_data(device, cycles);
+	if (r == 0) {
+		k8055_aggregate(device);
+		k8055_decode_input(device, bitmask, analog0, analog1, counter0, counter1);
+	}
+	k8055_release(device);
+	return r;
+}
+
+int k8055_set_poll_interval(k8055_device* device, int min_interval, int max_interval) {
+	if (min_interval < 1 || max_interval < min_interval) {
+		print_error("invalid poll interval bounds");
+		return K8055_ERROR_INDEX;
+	}
+	k8055_acquire(device, PRIORITY_OUTPUT);
+	device->poll_min_interval = min_interval;
+	device->poll_max_interval = max_interval;
+	if (device->poll_interval < min_interval)
+		device->poll_interval = min_interval;
+	if (device->poll_interval > max_interval)
+		device->poll_interval = max_interval;
+	k8055_release(device);
+	return 0;
+}
+
+int k8055_set_poll_deadband(k8055_device* device, int deadband) {
+	if (deadband < 0 || deadband > 255) {
+		print_error("invalid poll deadband");
+		return K8055_ERROR_INDEX;
+	}
+	k8055_acquire(device, PRIORITY_OUTPUT);
+	device->poll_deadband = deadband;
+	k8055_release(device);
 	return 0;
 }
 
+int k8055_get_poll_interval(k8055_device* device) {
+	k8055_acquire(device, PRIORITY_OUTPUT);
+	int interval = device->poll_interval;
+	k8055_release(device);
+	return interval;
+}
+
+int k8055_poll_timeout(k8055_device* device) {
+	k8055_acquire(device, PRIORITY_OUTPUT);
+	uint64_t due = device->poll_due;
+	k8055_release(device);
+	uint64_t now = k8055_now();
+	if (due <= now)
+		return 0;
+	return (int) ((due - now + 999) / 1000);
+}
+
+int k8055_poll(k8055_device* device, int *bitmask, int *analog0,
+		int *analog1, int *counter0, int *counter1) {
+	k8055_acquire(device, PRIORITY_INPUT);
+	int r = k8055_read_data(device, 2);
+	if (r != 0) {
+		k8055_release(device);
+		return r;
+	}
+
+	int changed = 0;
+	for (int i = 0; i < PACKET_LENGTH; ++i) {
+		if (i == IN_STATUS_OFFSET)
+			continue;
+		if (i == IN_ANALOG_0_OFFSET || i == IN_ANALOG_1_OFFSET) {
+			/* compared to the value at the last change, so that slow drifts are still noticed */
+			if (abs(device->data_in[i] - device->poll_last[i]) <= device->poll_deadband)
+				continue;
+		}
+		if (device->data_in[i] != device->poll_last[i])
+			changed = 1;
+		device->poll_last[i] = device->data_in[i];
+	}
+
+	if (changed) /* inputs are active, poll as often as allowed */
+		device->poll_interval = device->poll_min_interval;
+	else if (device->poll_interval < device->poll_max_interval / 2)
+		device->poll_interval *= 2;
+	else
+		device->poll_interval = device->poll_max_interval;
+	device->poll_due = k8055_now() + (uint64_t) device->poll_interval * 1000;
+
+	k8055_aggregate(device);
+	k8055_decode_input(device, bitmask, analog0, analog1, counter0, counter1);
+	k8055_release(device);
+	return changed;
+}
+
 void k8055_get_all_output(k8055_device* device, int* bitmask, int *analog0,
 		int *analog1, int *debounce0, int *debounce1) {
+	k8055_acquire(device, PRIORITY_OUTPUT);
 	
 	if (bitmask != NULL)
 		*bitmask = device->current_out[OUT_DIGITAL_OFFSET];
@@ -470,4 +1321,5 @@ void k8055_get_all_output(k8055_device* device, int* bitmask, int *analog0,
 		*debounce0 = k8055_char_to_ms(device->current_out[OUT_COUNTER_0_DEBOUNCE_OFFSET]);
 	if (debounce1 != NULL)
 		*debounce1 = k8055_char_to_ms(device->current_out[OUT_COUNTER_1_DEBOUNCE_OFFSET]);
+	k8055_release(device);
 }
@@ -43,6 +43,7 @@
 #define K8055_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -56,13 +57,58 @@ enum k8055_error_code {
 	K8055_ERROR_NO_K8055 = -4, /* Velleman k8055 cannot be found (on given port) */
 	K8055_ERROR_ACCESS = -6, /* access denied (insufficient permissions) */
 	K8055_ERROR_OPEN = -7, /* error opening device handle (also applies for claiming and detaching kernel driver) */
-	K8055_ERROR_CLOSED = -8, /* device is already closed */
+	K8055_ERROR_CLOSED = -8, /* device is already closed, or must be closed and reopened after libusb lost a transfer */
 	K8055_ERROR_WRITE = -9, /* write error */
 	K8055_ERROR_READ = -10, /* read error */
 	K8055_ERROR_INDEX = -11, /* invalid argument (i.e. trying to access analog channel >= 2) */
 	K8055_ERROR_MEM = -12 /* memory allocation error */
 };
 
+/** Type of a trace event. */
+enum k8055_trace_type {
+	K8055_TRACE_WRITE = 1, /* packet written to the board */
+	K8055_TRACE_READ = 2 /* packet read from the board */
+};
+
+/** Trace event, recorded for every packet transfer (including retries) of a device.
+ * Events have a fixed size and layout so that they can be stored in binary form, see tracedump.c. */
+struct k8055_trace_event {
+	uint64_t time; /* [us] time at which the transfer was submitted (monotonic clock) */
+	uint32_t latency; /* [us] time between submission and completion of the transfer */
+	uint32_t sequence; /* number of events recorded for the device before this one */
+	int32_t status; /* 0 on success, libusb error code otherwise */
+	uint8_t type; /* k8055_trace_type */
+	uint8_t command; /* command byte of written packets, 0 for read packets */
+	uint8_t attempt; /* 0 for the first try, incremented on every retry */
+	uint8_t length; /* number of bytes transferred */
+};
+
+/** Aggregate of the inputs read from a board during a window of time, see k8055_add_window().
+ * Analog statistics are 0 if no inputs were read during the window (samples is 0). */
+struct k8055_window {
+	uint64_t start; /* [us] start of the window (monotonic clock) */
+	int samples; /* number of times inputs were read during the window */
+	int analog_min[2];
+	int analog_max[2];
+	double analog_mean[2];
+	double analog_stddev[2];
+	int counter_delta[2]; /* counts added to each counter during the window */
+	int digital_on; /* bitmask of digital inputs that were on in at least one sample */
+	int dropped; /* windows completed since the previous k8055_read_window() but not returned */
+};
+
+/** Output state of a board, see k8055_write_sequence(). */
+struct k8055_output {
+	int digital; /* bitmask of digital outputs */
+	int analog0; /* value of first analog output */
+	int analog1; /* value of second analog output */
+};
+
+/** Flags of k8055_write_sequence(). */
+enum k8055_sequence_flags {
+	K8055_SEQUENCE_STOP_ON_ERROR = 1 /* submit no more states after a failure (packets already in flight still complete) */
+};
+
 void k8055_debug(bool value);
 
 /**Opens a K8055 device on the given port (i.e. address).
@@ -76,9 +122,25 @@ void k8055_debug(bool value);
  * @return K8055_ERROR_MEM if memory could not be allocated for device */
 int k8055_open_device(int port, k8055_device** device);
 
-/** Closes the given device. */
+/** Closes the given device. Transfers that libusb failed to give back after an error are cancelled
+ * first; if they still cannot be drained, the device's memory is not freed, as libusb may still use it. */
 void k8055_close_device(k8055_device* device);
 
+/**Enables or disables recording of trace events for the given device. Tracing is enabled when a
+ * device is opened; recording an event costs two clock readings and a copy into a buffer.
+ * @param device k8055 board
+ * @param enable 'true' to record events, 'false' to stop recording */
+void k8055_trace(k8055_device* device, bool enable);
+
+/**Moves the oldest trace events recorded for the given device into the passed array.
+ * A device keeps its last 256 events; older events are overwritten if they are not read in time,
+ * which shows as a gap in the events' sequence numbers.
+ * @param device k8055 board
+ * @param events array receiving the events, oldest first
+ * @param length maximum number of events to read
+ * @return number of events read */
+int k8055_read_trace(k8055_device* device, struct k8055_trace_event* events, int length);
+
 /**Sets all digital ouputs according to the given bitmask.
  * @param device k8055 board
  * @param bitmask '1' for 'on', '0' for 'off'
@@ -102,6 +164,23 @@ int k8055_set_digital(k8055_device* device, int channel, bool value);
  * @return K8055_ERROR_WRITE if another error occurred during the write process */
 int k8055_set_all_analog(k8055_device* device, int analog0, int analog1);
 
+/**Writes a sequence of output states to a board, in order. Several packets are kept in flight, so that
+ * states are written at the rate of the board's endpoint instead of one round trip per state. A failed
+ * packet is not retried (retrying it would reorder the sequence) and writing continues with the next state
+ * unless K8055_SEQUENCE_STOP_ON_ERROR is set. The board's output status is updated as each packet completes.
+ * @param device k8055 board
+ * @param states output states to write
+ * @param n number of states
+ * @param status receives the status of each state's packet: 0 if it was written, K8055_ERROR_WRITE if it
+ * failed or was not written because of an earlier failure, K8055_ERROR_CLOSED for all states if the device
+ * is not open. NULL is a valid parameter.
+ * @param flags bitwise or of k8055_sequence_flags, 0 for none
+ * @return 0 if all states were written
+ * @return K8055_ERROR_CLOSED if the given device is not open
+ * @return K8055_ERROR_WRITE if any state could not be written */
+int k8055_write_sequence(k8055_device* device, const struct k8055_output* states, int n,
+		int* status, int flags);
+
 /**Sets the value for an analog output at a given channel.
  * @param device k8055 board
  * @param channel channel of analog output (zero indexed)
@@ -143,6 +222,75 @@ int k8055_set_debounce_time(k8055_device* device, int counter, int debounce);
 int k8055_get_all_input(k8055_device* device, int *digitalBitmask, int *analog0,
 		int *analog1, int *counter0, int *counter1, bool quick);
 		
+/**Sets the bounds of the interval at which a given board should be polled, see k8055_poll().
+ * The bounds are 10 [ms] and 1000 [ms] when a device is opened.
+ * @param device k8055 board
+ * @param min_interval interval used while inputs are changing [ms]
+ * @param max_interval interval approached while inputs are idle [ms]
+ * @return 0 on success
+ * @return K8055_ERROR_INDEX if min_interval < 1 or max_interval < min_interval */
+int k8055_set_poll_interval(k8055_device* device, int min_interval, int max_interval);
+
+/**Sets the deadband of a given board's analog inputs in k8055_poll(): an analog input only counts as
+ * changed if it differs by more than the deadband from its value at its last change. Digital inputs and
+ * counters always count. The deadband is 1 when a device is opened, which ignores the jitter of the
+ * board's analog to digital converter.
+ * @param device k8055 board
+ * @param deadband [0-255], 0 to count every change
+ * @return 0 on success
+ * @return K8055_ERROR_INDEX if deadband is out of range */
+int k8055_set_poll_deadband(k8055_device* device, int deadband);
+
+/**Gets the interval at which a given board should currently be polled [ms].
+ * @param device k8055 board */
+int k8055_get_poll_interval(k8055_device* device);
+
+/**Gets the time until a given board is due to be polled again [ms], 0 if it is due now.
+ * Programs watching several boards poll the ones that are due and sleep for the smallest timeout.
+ * @param device k8055 board */
+int k8055_poll_timeout(k8055_device* device);
+
+/**Reads all current data of a given board like k8055_get_all_input() and adapts the board's poll interval
+ * to input activity. If any input changed since the previous poll (analog inputs by more than the deadband,
+ * see k8055_set_poll_deadband()), the interval is reset to its minimum,
+ * otherwise it is doubled up to its maximum. The board is due again after the new interval. NULL is a valid parameter.
+ * @param device k8055 board
+ * @param digitalBitmask bitmask value of digital inputs (there are 5 digital inputs)
+ * @param analog0 value of first analog input
+ * @param analog1 value of second analog input
+ * @param counter0 value of first counter
+ * @param counter1 value of second counter
+ * @return 1 if any input changed since the previous poll, 0 otherwise
+ * @return K8055_ERROR_CLOSED if the given device is not open
+ * @return K8055_ERROR_READ if another error occurred during the read process */
+int k8055_poll(k8055_device* device, int *digitalBitmask, int *analog0,
+		int *analog1, int *counter0, int *counter1);
+
+/**Adds a window over which the inputs read from a given board are aggregated. Every input read
+ * (by k8055_get_all_input() or k8055_poll()) is added to all of the board's windows, in constant time.
+ * A window is completed by the first read after its end; a new window then starts every 'hop' [ms].
+ * Windows are tumbling if hop equals length and sliding (overlapping) if hop is smaller.
+ * Counter deltas are measured from the last read before the window was added.
+ * At most 4 windows can be added to a board.
+ * @param device k8055 board
+ * @param length length of the window [ms]
+ * @param hop time between the starts of two consecutive windows [ms], length must be a multiple of hop
+ * and at most 8 times larger
+ * @return index of the window on success
+ * @return K8055_ERROR_INDEX if length or hop is invalid or the board has no window left */
+int k8055_add_window(k8055_device* device, int length, int hop);
+
+/**Gets the last completed aggregate of a given board's window. If several windows were completed since
+ * the previous call, only the last one is kept, except that an empty window never replaces one holding
+ * samples: when reads resume after a gap, the window read before the gap is returned. The windows not
+ * returned are counted in the aggregate's dropped field.
+ * @param device k8055 board
+ * @param window index of the window, as returned by k8055_add_window()
+ * @param aggregate receives the aggregate, unchanged if no window was completed since the previous call
+ * @return 1 if a window was completed since the previous call, 0 otherwise
+ * @return K8055_ERROR_INDEX if window is an invalid index */
+int k8055_read_window(k8055_device* device, int window, struct k8055_window* aggregate);
+
 /**Gets a given board's current output status. NULL is a valid parameter.
  * Note: as the K8055's firmware does not provide any method for querying the board's output status,
  * this library only tracks the board's status by recording any successfull data writes.
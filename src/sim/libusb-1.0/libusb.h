@@ -0,0 +1,116 @@
+/* Simulated libusb-1.0 for k8055 tests
+
+ This header replaces <libusb-1.0/libusb.h> when the library is built
+ against the simulated board (see sim.h). It declares only the subset of
+ libusb used by k8055.c, with the same names, values and semantics as the
+ real library, so that k8055.c compiles unchanged.
+*/
+
+#ifndef SIM_LIBUSB_H_
+#define SIM_LIBUSB_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define LIBUSB_CALL
+#define LIBUSB_API_VERSION 0x01000105
+
+enum libusb_error {
+	LIBUSB_SUCCESS = 0,
+	LIBUSB_ERROR_IO = -1,
+	LIBUSB_ERROR_INVALID_PARAM = -2,
+	LIBUSB_ERROR_ACCESS = -3,
+	LIBUSB_ERROR_NO_DEVICE = -4,
+	LIBUSB_ERROR_NOT_FOUND = -5,
+	LIBUSB_ERROR_BUSY = -6,
+	LIBUSB_ERROR_TIMEOUT = -7,
+	LIBUSB_ERROR_OVERFLOW = -8,
+	LIBUSB_ERROR_PIPE = -9,
+	LIBUSB_ERROR_INTERRUPTED = -10,
+	LIBUSB_ERROR_NO_MEM = -11,
+	LIBUSB_ERROR_NOT_SUPPORTED = -12,
+	LIBUSB_ERROR_OTHER = -99
+};
+
+enum libusb_transfer_status {
+	LIBUSB_TRANSFER_COMPLETED,
+	LIBUSB_TRANSFER_ERROR,
+	LIBUSB_TRANSFER_TIMED_OUT,
+	LIBUSB_TRANSFER_CANCELLED,
+	LIBUSB_TRANSFER_STALL,
+	LIBUSB_TRANSFER_NO_DEVICE,
+	LIBUSB_TRANSFER_OVERFLOW
+};
+
+enum libusb_transfer_type {
+	LIBUSB_TRANSFER_TYPE_INTERRUPT = 3
+};
+
+typedef struct libusb_context libusb_context;
+typedef struct libusb_device libusb_device;
+typedef struct libusb_device_handle libusb_device_handle;
+
+struct libusb_device_descriptor {
+	uint16_t idVendor;
+	uint16_t idProduct;
+};
+
+struct libusb_transfer;
+typedef void (LIBUSB_CALL *libusb_transfer_cb_fn)(struct libusb_transfer *transfer);
+
+struct libusb_transfer {
+	libusb_device_handle *dev_handle;
+	uint8_t flags;
+	unsigned char endpoint;
+	unsigned char type;
+	unsigned int timeout;
+	enum libusb_transfer_status status;
+	int length;
+	int actual_length;
+	libusb_transfer_cb_fn callback;
+	void *user_data;
+	unsigned char *buffer;
+	int num_iso_packets;
+};
+
+int libusb_init(libusb_context **ctx);
+void libusb_exit(libusb_context *ctx);
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list);
+void libusb_free_device_list(libusb_device **list, int unref_devices);
+int libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc);
+
+int libusb_open(libusb_device *dev, libusb_device_handle **handle);
+void libusb_close(libusb_device_handle *handle);
+int libusb_kernel_driver_active(libusb_device_handle *handle, int interface_number);
+int libusb_detach_kernel_driver(libusb_device_handle *handle, int interface_number);
+int libusb_claim_interface(libusb_device_handle *handle, int interface_number);
+int libusb_release_interface(libusb_device_handle *handle, int interface_number);
+
+unsigned char *libusb_dev_mem_alloc(libusb_device_handle *handle, size_t length);
+int libusb_dev_mem_free(libusb_device_handle *handle, unsigned char *buffer, size_t length);
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets);
+void libusb_free_transfer(struct libusb_transfer *transfer);
+int libusb_submit_transfer(struct libusb_transfer *transfer);
+int libusb_cancel_transfer(struct libusb_transfer *transfer);
+int libusb_handle_events_completed(libusb_context *ctx, int *completed);
+
+int libusb_interrupt_transfer(libusb_device_handle *handle, unsigned char endpoint,
+		unsigned char *data, int length, int *transferred, unsigned int timeout);
+
+static inline void libusb_fill_interrupt_transfer(struct libusb_transfer *transfer,
+		libusb_device_handle *dev_handle, unsigned char endpoint, unsigned char *buffer,
+		int length, libusb_transfer_cb_fn callback, void *user_data, unsigned int timeout) {
+	transfer->dev_handle = dev_handle;
+	transfer->endpoint = endpoint;
+	transfer->type = LIBUSB_TRANSFER_TYPE_INTERRUPT;
+	transfer->timeout = timeout;
+	transfer->buffer = buffer;
+	transfer->length = length;
+	transfer->user_data = user_data;
+	transfer->callback = callback;
+}
+
+#endif /* SIM_LIBUSB_H_ */
@@ -0,0 +1,507 @@
+/* Simulated k8055 boards, see sim.h */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "libusb-1.0/libusb.h"
+#include "sim.h"
+
+#define SIM_PORTS 4
+#define SIM_MAX_PENDING 64
+#define PACKET_LENGTH 8
+#define VELLEMAN_VENDOR_ID 0x10cf
+#define K8055_PRODUCT_ID 0x5500
+#define USB_OUT_EP 0x01
+
+struct libusb_context {
+	int unused;
+};
+
+struct libusb_device {
+	int port;
+};
+
+struct libusb_device_handle {
+	int port;
+	int generation; /* generation of the board when it was opened */
+};
+
+/** State of a simulated board. */
+struct sim_board {
+	bool plugged;
+	int generation; /* incremented every time the board is unplugged */
+	unsigned char digital_out;
+	unsigned char previous_out; /* digital outputs seen by the inputs until out_changed + firmware_delay */
+	long long out_changed; /* [us] */
+	unsigned char analog_out[2];
+	int counter[2];
+	int inputs; /* digital inputs at the last sample, for edge counting */
+	unsigned char buffered[PACKET_LENGTH]; /* input packet held by the firmware */
+	long long endpoint_free[2]; /* [us] time at which the OUT and IN endpoints are idle */
+};
+
+/** A submitted transfer awaiting completion. */
+struct sim_pending {
+	struct libusb_transfer *transfer;
+	long long deadline; /* [us] */
+	enum libusb_transfer_status status;
+	int actual_length;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER; /* held while handling events, like libusb's event lock */
+static struct libusb_device devices[SIM_PORTS] = {{0}, {1}, {2}, {3}};
+static struct sim_board boards[SIM_PORTS] = {{true}, {true}, {true}, {true}};
+static struct sim_pending pending[SIM_MAX_PENDING];
+static int pending_count = 0;
+static struct sim_config config = {100, 0, 0, 0.0, 0.0, 0.0, 0, {0, 1, 2, 3, 4, -1, -1, -1}};
+static struct sim_stats stats = {0, 0, 0, 0, 0};
+static int event_failures = 0; /* calls to libusb_handle_events_completed() left to fail */
+static unsigned int random_state = 1;
+
+static long long sim_now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (long long) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static void sim_sleep(long long us) {
+	struct timespec t;
+	t.tv_sec = us / 1000000;
+	t.tv_nsec = (us % 1000000) * 1000;
+	nanosleep(&t, NULL);
+}
+
+/** Returns a random number in [0, 1), must be called with the lock held. */
+static double sim_random(void) {
+	random_state = random_state * 1103515245 + 12345;
+	return (random_state >> 8) / 16777216.0;
+}
+
+static void sim_reset_board(struct sim_board* board) {
+	board->digital_out = 0;
+	board->previous_out = 0;
+	board->out_changed = 0;
+	board->analog_out[0] = 0;
+	board->analog_out[1] = 0;
+	board->counter[0] = 0;
+	board->counter[1] = 0;
+	board->inputs = 0;
+	memset(board->buffered, 0, PACKET_LENGTH);
+	board->endpoint_free[0] = 0;
+	board->endpoint_free[1] = 0;
+}
+
+/** Returns the digital outputs of a board as seen by its inputs at the given time. */
+static int sim_visible_out(struct sim_board* board, long long now) {
+	if (now < board->out_changed + config.firmware_delay)
+		return board->previous_out;
+	return board->digital_out;
+}
+
+/** Samples the inputs of a board into an input packet, according to the loopback wiring. */
+static void sim_sample(int port, unsigned char* packet) {
+	struct sim_board* board = &boards[port];
+	int out = sim_visible_out(board, sim_now());
+	int in = 0;
+	for (int i = 0; i < 8; ++i)
+		if (config.loopback[i] >= 0 && (out & (1 << i)))
+			in |= 1 << config.loopback[i];
+
+	/* counters count rising edges of inputs 1 and 2 */
+	if ((in & 0x01) && !(board->inputs & 0x01))
+		board->counter[0] = (board->counter[0] + 1) & 0xffff;
+	if ((in & 0x02) && !(board->inputs & 0x02))
+		board->counter[1] = (board->counter[1] + 1) & 0xffff;
+	board->inputs = in;
+
+	packet[0] = ((in & 0x03) << 4) | ((in >> 2) & 0x01) | ((in & 0x18) << 3);
+	packet[1] = port + 1;
+	packet[2] = board->analog_out[0];
+	packet[3] = board->analog_out[1];
+	packet[4] = board->counter[0] & 0xff;
+	packet[5] = board->counter[0] >> 8;
+	packet[6] = board->counter[1] & 0xff;
+	packet[7] = board->counter[1] >> 8;
+}
+
+/** Applies the effect of a completed transfer to its board, must be called with the lock held. */
+static void sim_complete(struct sim_pending* p) {
+	struct libusb_transfer *transfer = p->transfer;
+	int port = transfer->dev_handle->port;
+	struct sim_board* board = &boards[port];
+
+	transfer->status = p->status;
+	transfer->actual_length = 0;
+	if (p->status == LIBUSB_TRANSFER_COMPLETED
+			&& (!board->plugged || board->generation != transfer->dev_handle->generation))
+		transfer->status = LIBUSB_TRANSFER_NO_DEVICE; /* unplugged while in flight */
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		return;
+
+	transfer->actual_length = p->actual_length;
+	if (transfer->endpoint == USB_OUT_EP) {
+		if (p->actual_length < PACKET_LENGTH)
+			return;
+		unsigned char *packet = transfer->buffer;
+		switch (packet[0]) {
+		case 3:
+			board->counter[0] = 0;
+			break;
+		case 4:
+			board->counter[1] = 0;
+			break;
+		case 5:
+			if (packet[1] != board->digital_out) {
+				long long now = sim_now();
+				board->previous_out = sim_visible_out(board, now);
+				board->out_changed = now;
+			}
+			board->digital_out = packet[1];
+			board->analog_out[0] = packet[2];
+			board->analog_out[1] = packet[3];
+			break;
+		}
+	} else {
+		memcpy(transfer->buffer, board->buffered, p->actual_length);
+		sim_sample(port, board->buffered);
+	}
+	stats.transfers += 1;
+}
+
+void sim_default_config(struct sim_config* c) {
+	c->latency = 100;
+	c->interval = 0;
+	c->spike_latency = 0;
+	c->spike_rate = 0.0;
+	c->timeout_rate = 0.0;
+	c->short_rate = 0.0;
+	c->firmware_delay = 0;
+	for (int i = 0; i < 8; ++i)
+		c->loopback[i] = i < 5 ? i : -1;
+}
+
+void sim_configure(const struct sim_config* c) {
+	pthread_mutex_lock(&lock);
+	config = *c;
+	pthread_mutex_unlock(&lock);
+}
+
+void sim_get_config(struct sim_config* c) {
+	pthread_mutex_lock(&lock);
+	*c = config;
+	pthread_mutex_unlock(&lock);
+}
+
+void sim_plug(int port, bool plugged) {
+	pthread_mutex_lock(&lock);
+	if (boards[port].plugged && !plugged)
+		boards[port].generation += 1;
+	if (!boards[port].plugged && plugged)
+		sim_reset_board(&boards[port]);
+	boards[port].plugged = plugged;
+	pthread_mutex_unlock(&lock);
+}
+
+void sim_fail_events(int calls) {
+	pthread_mutex_lock(&lock);
+	event_failures = calls;
+	pthread_mutex_unlock(&lock);
+}
+
+void sim_seed(unsigned int seed) {
+	pthread_mutex_lock(&lock);
+	random_state = seed;
+	pthread_mutex_unlock(&lock);
+}
+
+void sim_get_stats(struct sim_stats* s) {
+	pthread_mutex_lock(&lock);
+	*s = stats;
+	pthread_mutex_unlock(&lock);
+}
+
+int libusb_init(libusb_context **ctx) {
+	*ctx = malloc(sizeof(libusb_context));
+	if (*ctx == NULL)
+		return LIBUSB_ERROR_NO_MEM;
+	pthread_mutex_lock(&lock);
+	if (getenv("K8055_SIM_LATENCY") != NULL)
+		config.latency = atoi(getenv("K8055_SIM_LATENCY"));
+	if (getenv("K8055_SIM_INTERVAL") != NULL)
+		config.interval = atoi(getenv("K8055_SIM_INTERVAL"));
+	if (getenv("K8055_SIM_FIRMWARE_DELAY") != NULL)
+		config.firmware_delay = atoi(getenv("K8055_SIM_FIRMWARE_DELAY"));
+	stats.allocations += 1;
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+void libusb_exit(libusb_context *ctx) {
+	free(ctx);
+	pthread_mutex_lock(&lock);
+	stats.allocations -= 1;
+	pthread_mutex_unlock(&lock);
+}
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list) {
+	*list = malloc((SIM_PORTS + 1) * sizeof(libusb_device*));
+	if (*list == NULL)
+		return LIBUSB_ERROR_NO_MEM;
+	ssize_t size = 0;
+	pthread_mutex_lock(&lock);
+	for (int i = 0; i < SIM_PORTS; ++i)
+		if (boards[i].plugged)
+			(*list)[size++] = &devices[i];
+	(*list)[size] = NULL;
+	stats.allocations += 1;
+	pthread_mutex_unlock(&lock);
+	return size;
+}
+
+void libusb_free_device_list(libusb_device **list, int unref_devices) {
+	free(list);
+	pthread_mutex_lock(&lock);
+	stats.allocations -= 1;
+	pthread_mutex_unlock(&lock);
+}
+
+int libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc) {
+	desc->idVendor = VELLEMAN_VENDOR_ID;
+	desc->idProduct = K8055_PRODUCT_ID + dev->port;
+	return 0;
+}
+
+int libusb_open(libusb_device *dev, libusb_device_handle **handle) {
+	pthread_mutex_lock(&lock);
+	if (!boards[dev->port].plugged) {
+		pthread_mutex_unlock(&lock);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	*handle = malloc(sizeof(libusb_device_handle));
+	if (*handle == NULL) {
+		pthread_mutex_unlock(&lock);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	(*handle)->port = dev->port;
+	(*handle)->generation = boards[dev->port].generation;
+	stats.handles += 1;
+	stats.allocations += 1;
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+void libusb_close(libusb_device_handle *handle) {
+	free(handle);
+	pthread_mutex_lock(&lock);
+	stats.handles -= 1;
+	stats.allocations -= 1;
+	pthread_mutex_unlock(&lock);
+}
+
+int libusb_kernel_driver_active(libusb_device_handle *handle, int interface_number) {
+	return 0;
+}
+
+int libusb_detach_kernel_driver(libusb_device_handle *handle, int interface_number) {
+	return 0;
+}
+
+int libusb_claim_interface(libusb_device_handle *handle, int interface_number) {
+	return 0;
+}
+
+int libusb_release_interface(libusb_device_handle *handle, int interface_number) {
+	return 0;
+}
+
+unsigned char *libusb_dev_mem_alloc(libusb_device_handle *handle, size_t length) {
+	unsigned char *buffer = malloc(length);
+	if (buffer != NULL) {
+		pthread_mutex_lock(&lock);
+		stats.allocations += 1;
+		pthread_mutex_unlock(&lock);
+	}
+	return buffer;
+}
+
+int libusb_dev_mem_free(libusb_device_handle *handle, unsigned char *buffer, size_t length) {
+	free(buffer);
+	pthread_mutex_lock(&lock);
+	stats.allocations -= 1;
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets) {
+	struct libusb_transfer *transfer = calloc(1, sizeof(struct libusb_transfer));
+	if (transfer != NULL) {
+		pthread_mutex_lock(&lock);
+		stats.allocations += 1;
+		pthread_mutex_unlock(&lock);
+	}
+	return transfer;
+}
+
+void libusb_free_transfer(struct libusb_transfer *transfer) {
+	if (transfer == NULL)
+		return;
+	pthread_mutex_lock(&lock);
+	for (int i = 0; i < pending_count; ++i) {
+		if (pending[i].transfer == transfer) { /* forget it rather than complete it after it is freed */
+			pending[i] = pending[--pending_count];
+			stats.freed_in_flight += 1;
+			break;
+		}
+	}
+	stats.allocations -= 1;
+	pthread_mutex_unlock(&lock);
+	free(transfer);
+}
+
+int libusb_submit_transfer(struct libusb_transfer *transfer) {
+	int port = transfer->dev_handle->port;
+	struct sim_board* board = &boards[port];
+
+	pthread_mutex_lock(&lock);
+	if (!board->plugged || board->generation != transfer->dev_handle->generation) {
+		pthread_mutex_unlock(&lock);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	if (pending_count == SIM_MAX_PENDING) {
+		pthread_mutex_unlock(&lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+
+	struct sim_pending* p = &pending[pending_count++];
+	p->transfer = transfer;
+	p->status = LIBUSB_TRANSFER_COMPLETED;
+	p->actual_length = transfer->length < PACKET_LENGTH ? transfer->length : PACKET_LENGTH;
+
+	/* packets on an endpoint are serialized and spaced by the endpoint's interval */
+	int ep = transfer->endpoint == USB_OUT_EP ? 0 : 1;
+	long long now = sim_now();
+	long long start = board->endpoint_free[ep] > now ? board->endpoint_free[ep] : now;
+	long long latency = config.latency;
+	if (sim_random() < config.spike_rate)
+		latency += config.spike_latency;
+
+	if (sim_random() < config.timeout_rate) {
+		p->status = LIBUSB_TRANSFER_TIMED_OUT;
+		latency = (long long) transfer->timeout * 1000;
+		stats.faults += 1;
+	} else if (sim_random() < config.short_rate) {
+		p->actual_length = (int) (sim_random() * p->actual_length);
+		stats.faults += 1;
+	}
+	p->deadline = start + latency;
+	if (transfer->timeout > 0 && p->deadline - now > (long long) transfer->timeout * 1000) {
+		/* still queued on the endpoint when the timeout expires, the packet is never sent */
+		p->status = LIBUSB_TRANSFER_TIMED_OUT;
+		p->deadline = now + (long long) transfer->timeout * 1000;
+	} else {
+		board->endpoint_free[ep] = start + (latency > config.interval ? latency : config.interval);
+	}
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+int libusb_cancel_transfer(struct libusb_transfer *transfer) {
+	pthread_mutex_lock(&lock);
+	for (int i = 0; i < pending_count; ++i) {
+		if (pending[i].transfer == transfer) {
+			pending[i].status = LIBUSB_TRANSFER_CANCELLED;
+			pending[i].deadline = 0;
+			pthread_mutex_unlock(&lock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int libusb_handle_events_completed(libusb_context *ctx, int *completed) {
+	/* as in libusb, only one thread at a time handles events and runs callbacks, and
+	 * 'completed' is checked with the event lock held */
+	pthread_mutex_lock(&event_lock);
+	if (completed != NULL && *completed) {
+		pthread_mutex_unlock(&event_lock);
+		return 0;
+	}
+
+	pthread_mutex_lock(&lock);
+	if (event_failures > 0) {
+		event_failures -= 1;
+		pthread_mutex_unlock(&lock);
+		pthread_mutex_unlock(&event_lock);
+		return LIBUSB_ERROR_IO;
+	}
+
+	int next = -1;
+	for (int i = 0; i < pending_count; ++i)
+		if (next < 0 || pending[i].deadline < pending[next].deadline)
+			next = i;
+	if (next < 0) {
+		pthread_mutex_unlock(&lock);
+		pthread_mutex_unlock(&event_lock);
+		sim_sleep(100);
+		return 0;
+	}
+
+	long long wait = pending[next].deadline - sim_now();
+	if (wait > 0) {
+		pthread_mutex_unlock(&lock);
+		pthread_mutex_unlock(&event_lock);
+		sim_sleep(wait < 1000 ? wait : 1000);
+		return 0;
+	}
+
+	struct sim_pending p = pending[next];
+	pending[next] = pending[--pending_count];
+	sim_complete(&p);
+	pthread_mutex_unlock(&lock);
+
+	p.transfer->callback(p.transfer);
+	pthread_mutex_unlock(&event_lock);
+	return 0;
+}
+
+static void LIBUSB_CALL sim_sync_callback(struct libusb_transfer *transfer) {
+	*(int*) transfer->user_data = 1;
+}
+
+int libusb_interrupt_transfer(libusb_device_handle *handle, unsigned char endpoint,
+		unsigned char *data, int length, int *transferred, unsigned int timeout) {
+	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+	if (transfer == NULL)
+		return LIBUSB_ERROR_NO_MEM;
+
+	int completed = 0;
+	libusb_fill_interrupt_transfer(transfer, handle, endpoint, data, length,
+			sim_sync_callback, &completed, timeout);
+	int r = libusb_submit_transfer(transfer);
+	if (r < 0) {
+		libusb_free_transfer(transfer);
+		return r;
+	}
+	while (!completed)
+		libusb_handle_events_completed(NULL, &completed);
+
+	*transferred = transfer->actual_length;
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		r = 0;
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		r = LIBUSB_ERROR_TIMEOUT;
+		break;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		r = LIBUSB_ERROR_NO_DEVICE;
+		break;
+	default:
+		r = LIBUSB_ERROR_IO;
+	}
+	libusb_free_transfer(transfer);
+	return r;
+}
@@ -0,0 +1,74 @@
+/* Simulated k8055 boards
+
+ A stand-in for libusb that emulates up to four Velleman K8055 boards, so that
+ the library's transport path can be exercised without hardware. Programs are
+ linked against sim.c instead of libusb-1.0 and compiled with this directory on
+ the include path, which makes <libusb-1.0/libusb.h> resolve to the simulated
+ header. k8055.c itself is compiled unchanged.
+
+ Transfers complete asynchronously after a configurable latency, and faults
+ (timeouts, short packets, latency spikes and device removal) can be injected
+ at configurable rates, and event handling can be made to fail. A transfer that cannot complete within its timeout, for
+ example because it is queued behind other packets on its endpoint, times out as it would
+ with real libusb. Like the real board, input packets are buffered by the
+ firmware, so a single read returns the state sampled at the previous read.
+
+ Digital outputs are wired back to digital inputs (by default outputs 1-5 to inputs 1-5)
+ and become visible there after a modelled firmware delay. The analog outputs are wired
+ to the analog inputs. Besides sim_configure(), the environment variables
+ K8055_SIM_LATENCY, K8055_SIM_INTERVAL and K8055_SIM_FIRMWARE_DELAY [us] override the
+ configuration when libusb is initialized, so that unmodified programs can be run
+ against differently behaving boards.
+*/
+
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <stdbool.h>
+
+/** Behaviour of the simulated boards. Rates are probabilities per transfer [0-1]. */
+struct sim_config {
+	int latency; /* [us] time for a transfer to complete */
+	int interval; /* [us] minimum time between two packets on the same endpoint */
+	int spike_latency; /* [us] additional latency of a delayed transfer */
+	double spike_rate; /* rate of delayed transfers */
+	double timeout_rate; /* rate of transfers timing out */
+	double short_rate; /* rate of transfers completing with less than a full packet */
+	int firmware_delay; /* [us] time until a change of a digital output is visible at the inputs */
+	int loopback[8]; /* digital input (0-4) wired to each digital output, -1 for none */
+};
+
+/** Statistics on the simulated libusb, used to detect leaks and to count faults. */
+struct sim_stats {
+	long transfers; /* completed transfers */
+	long faults; /* injected timeouts and short transfers */
+	int handles; /* open device handles */
+	int allocations; /* outstanding contexts, device lists, handles, transfers and buffers */
+	int freed_in_flight; /* transfers freed while still submitted, which libusb does not allow */
+};
+
+/** Fills the given configuration with the defaults (fast board, no faults, no firmware delay,
+ * outputs 1-5 wired to inputs 1-5). */
+void sim_default_config(struct sim_config* config);
+
+/** Changes the behaviour of all simulated boards. */
+void sim_configure(const struct sim_config* config);
+
+/** Gets the current behaviour of the simulated boards, including overrides from the environment. */
+void sim_get_config(struct sim_config* config);
+
+/** Plugs or unplugs the board on the given port. Handles to an unplugged board
+ * stay invalid even after it is plugged in again; the board must be reopened.
+ * Boards on all ports are plugged in initially. */
+void sim_plug(int port, bool plugged);
+
+/** Makes the next given number of calls to libusb_handle_events_completed() fail with
+ * LIBUSB_ERROR_IO, as when event handling breaks, so that transfers cannot be given back. */
+void sim_fail_events(int calls);
+
+/** Seeds the fault injection. */
+void sim_seed(unsigned int seed);
+
+void sim_get_stats(struct sim_stats* stats);
+
+#endif /* SIM_H_ */
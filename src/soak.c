@@ -0,0 +1,342 @@
+/* Soak test of the k8055 transport path against simulated boards.
+
+ Threads drive simulated boards (see sim/sim.h) with a random mix of writes, reads and counter resets
+ for the given duration, while faults are injected at the configured rates and boards are unplugged
+ at random. By default every thread has its own board; with -n, several threads share each board, so
+ that requests are scheduled per board and transfers complete in other threads' event handling.
+ Threads check that the inputs read back reflect the outputs written (a thread sharing a board only
+ writes and checks its own digital output), reopen their board when it disappears and measure how
+ long it takes to recover from errors. At the end, throughput, recovery times and the number of
+ outstanding allocations, open file descriptors and resident memory are compared to their values
+ after start-up.
+
+ usage: k8055-soak [-d seconds] [-t threads] [-n threads per board] [-f fault rate] [-s spike rate]
+        [-l spike latency] [-u unplug interval]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include "k8055.h"
+#include "sim/sim.h"
+
+#define MAX_BOARDS 4 /* simulated boards */
+#define MAX_SHARING 4 /* threads per board, each one using its own digital output */
+#define MAX_THREADS (MAX_BOARDS * MAX_SHARING)
+#define REOPEN_ERRORS 3 /* consecutive errors after which a board is reopened */
+#define UNPLUG_TIME 50 /* [ms] time a board stays unplugged */
+
+/** Board driven by one or more workers. Workers hold the lock for reading while they use the
+ * device and for writing while they open or close it. */
+struct board {
+	pthread_rwlock_t lock;
+	int port;
+	k8055_device* device; /* NULL while closed */
+	bool opened; /* the board was opened before, opening it again is a reopen */
+};
+
+struct worker {
+	pthread_t thread;
+	struct board* board;
+	int channel; /* digital output written and checked, -1 for all if the board is not shared */
+	unsigned int seed;
+
+	long operations;
+	long errors;
+	long mismatches; /* inputs read back not matching the outputs written */
+	long reopens;
+	long recoveries;
+	double recovery_total; /* [ms] */
+	double recovery_max; /* [ms] */
+};
+
+static bool running = true;
+static pthread_mutex_t running_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool is_running(void) {
+	pthread_mutex_lock(&running_lock);
+	bool r = running;
+	pthread_mutex_unlock(&running_lock);
+	return r;
+}
+
+static double now_ms(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+static void sleep_ms(int ms) {
+	struct timespec t;
+	t.tv_sec = ms / 1000;
+	t.tv_nsec = (ms % 1000) * 1000000L;
+	nanosleep(&t, NULL);
+}
+
+/** Writes the worker's digital outputs: all of them, or only its own one if the board is shared. */
+static int write_digital(struct worker* w, k8055_device* device, int digital) {
+	if (w->channel < 0)
+		return k8055_set_all_digital(device, digital);
+	return k8055_set_digital(device, w->channel, (digital & (1 << w->channel)) != 0);
+}
+
+/** Performs a random operation on the device.
+ * @return 0 on success, a k8055 error code otherwise */
+static int random_operation(struct worker* w, k8055_device* device) {
+	int op = rand_r(&w->seed) % 8;
+	int digital = rand_r(&w->seed) % 256;
+	if (op < 3)
+		return write_digital(w, device, digital);
+	if (op < 5)
+		return k8055_set_analog(device, op - 3, rand_r(&w->seed) % 256);
+	if (op < 6)
+		return k8055_reset_counter(device, rand_r(&w->seed) % 2);
+
+	/* write and read back: the simulated board loops digital outputs 1-5 back to the inputs */
+	int r = write_digital(w, device, digital);
+	if (r != 0)
+		return r;
+	int inputs;
+	r = k8055_get_all_input(device, &inputs, NULL, NULL, NULL, NULL, false);
+	if (r != 0)
+		return r;
+	int mask = w->channel < 0 ? 0x1f : 1 << w->channel;
+	if ((inputs & mask) != (digital & mask))
+		w->mismatches += 1;
+	return 0;
+}
+
+/** Opens the worker's board unless another worker already did.
+ * @return false if the board could not be opened */
+static bool open_board(struct worker* w) {
+	struct board* b = w->board;
+	pthread_rwlock_wrlock(&b->lock);
+	bool open = b->device != NULL || k8055_open_device(b->port, &b->device) == 0;
+	if (open && !b->opened)
+		b->opened = true;
+	else if (open)
+		w->reopens += 1;
+	pthread_rwlock_unlock(&b->lock);
+	return open;
+}
+
+/** Closes the given device of the worker's board, unless another worker already closed it. */
+static void close_board(struct worker* w, k8055_device* device) {
+	struct board* b = w->board;
+	pthread_rwlock_wrlock(&b->lock);
+	if (b->device == device) {
+		k8055_close_device(device);
+		b->device = NULL;
+	}
+	pthread_rwlock_unlock(&b->lock);
+}
+
+static void* run_worker(void* arg) {
+	struct worker* w = (struct worker*) arg;
+	int consecutive_errors = 0;
+	double error_start = 0;
+	while (is_running()) {
+		pthread_rwlock_rdlock(&w->board->lock);
+		k8055_device* device = w->board->device;
+		if (device == NULL) { /* board disappeared, wait for it to come back */
+			pthread_rwlock_unlock(&w->board->lock);
+			if (!open_board(w))
+				sleep_ms(1);
+			continue;
+		}
+		int r = random_operation(w, device);
+		pthread_rwlock_unlock(&w->board->lock);
+
+		w->operations += 1;
+		if (r != 0) {
+			w->errors += 1;
+			if (consecutive_errors == 0)
+				error_start = now_ms();
+			consecutive_errors += 1;
+			if (consecutive_errors % REOPEN_ERRORS == 0)
+				close_board(w, device);
+		} else if (consecutive_errors > 0) {
+			double recovery = now_ms() - error_start;
+			w->recoveries += 1;
+			w->recovery_total += recovery;
+			if (recovery > w->recovery_max)
+				w->recovery_max = recovery;
+			consecutive_errors = 0;
+		}
+	}
+	return NULL;
+}
+
+static int count_fds(void) {
+	DIR* dir = opendir("/proc/self/fd");
+	if (dir == NULL)
+		return -1;
+	int n = 0;
+	while (readdir(dir) != NULL)
+		n += 1;
+	closedir(dir);
+	return n - 3; /* '.', '..' and the directory itself */
+}
+
+/** Resident memory [kB], -1 if unknown. */
+static long resident_kb(void) {
+	FILE* file = fopen("/proc/self/statm", "r");
+	if (file == NULL)
+		return -1;
+	long size, resident;
+	int n = fscanf(file, "%ld %ld", &size, &resident);
+	fclose(file);
+	if (n != 2)
+		return -1;
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void print_usage(void) {
+	puts("usage: k8055-soak [-d seconds] [-t threads] [-n threads per board] [-f fault rate] [-s spike rate]");
+	puts("       [-l spike latency] [-u unplug interval]");
+	puts("  -d  duration of the test [s], default 10");
+	puts("  -t  number of threads (1-16, at most 4 boards), default 4");
+	puts("  -n  number of threads sharing each board (1-4), default 1");
+	puts("  -f  rate of timeouts and of short transfers [0-1], default 0.01");
+	puts("  -s  rate of latency spikes [0-1], default 0.01");
+	puts("  -l  latency added by a spike [ms], default 5");
+	puts("  -u  mean time between unplugging a random board [s], 0 to disable, default 2");
+}
+
+int main(int argc, char *argv[]) {
+	int duration = 10;
+	int threads = MAX_BOARDS;
+	int sharing = 1;
+	double fault_rate = 0.01;
+	double spike_rate = 0.01;
+	double spike_latency = 5;
+	double unplug_interval = 2;
+
+	int c;
+	while ((c = getopt(argc, argv, "d:t:n:f:s:l:u:h")) != -1) {
+		switch (c) {
+		case 'd': duration = atoi(optarg); break;
+		case 't': threads = atoi(optarg); break;
+		case 'n': sharing = atoi(optarg); break;
+		case 'f': fault_rate = atof(optarg); break;
+		case 's': spike_rate = atof(optarg); break;
+		case 'l': spike_latency = atof(optarg); break;
+		case 'u': unplug_interval = atof(optarg); break;
+		default:
+			print_usage();
+			return -1;
+		}
+	}
+	if (sharing < 1 || sharing > MAX_SHARING || threads < 1 || threads > MAX_THREADS
+			|| (threads + sharing - 1) / sharing > MAX_BOARDS || spike_latency < 0) {
+		print_usage();
+		return -1;
+	}
+	int boards = (threads + sharing - 1) / sharing;
+
+	struct sim_config config;
+	sim_default_config(&config);
+	config.timeout_rate = fault_rate;
+	config.short_rate = fault_rate;
+	config.spike_rate = spike_rate;
+	config.spike_latency = (int) (spike_latency * 1000);
+	sim_configure(&config);
+	sim_seed((unsigned int) time(NULL));
+
+	printf("soak test: %d s, %d threads on %d boards, fault rate %.3f, spike rate %.3f (%.1f ms), unplug interval %.1f s\n",
+			duration, threads, boards, fault_rate, spike_rate, spike_latency, unplug_interval);
+
+	/* keep one board open for the whole test, so that the library's libusb context persists
+	 * and start-up allocations are not counted as leaks */
+	k8055_device* idle = NULL;
+	if (boards < MAX_BOARDS && k8055_open_device(MAX_BOARDS - 1, &idle) != 0) {
+		puts("could not open simulated board");
+		return -1;
+	}
+
+	struct board board_states[MAX_BOARDS];
+	for (int i = 0; i < boards; ++i) {
+		pthread_rwlock_init(&board_states[i].lock, NULL);
+		board_states[i].port = i;
+		board_states[i].device = NULL;
+		board_states[i].opened = false;
+	}
+	struct worker workers[MAX_THREADS] = {{0}};
+	for (int i = 0; i < threads; ++i) {
+		workers[i].board = &board_states[i / sharing];
+		workers[i].channel = sharing > 1 ? i % sharing : -1;
+		workers[i].seed = (unsigned int) time(NULL) + i;
+		pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+	}
+	sleep_ms(100);
+
+	struct sim_stats start_stats;
+	sim_get_stats(&start_stats);
+	int start_fds = count_fds();
+	long start_rss = resident_kb();
+	double start = now_ms();
+	unsigned int seed = (unsigned int) time(NULL);
+
+	while (now_ms() - start < duration * 1000.0) {
+		sleep_ms(10);
+		if (unplug_interval > 0 && rand_r(&seed) < RAND_MAX / (unplug_interval * 100)) {
+			int port = rand_r(&seed) % boards;
+			sim_plug(port, false);
+			sleep_ms(UNPLUG_TIME);
+			sim_plug(port, true);
+		}
+	}
+	sleep_ms(UNPLUG_TIME); /* give threads time to reopen */
+
+	struct sim_stats end_stats;
+	sim_get_stats(&end_stats);
+	int end_fds = count_fds();
+	long end_rss = resident_kb();
+	double elapsed = (now_ms() - start) / 1000.0;
+
+	pthread_mutex_lock(&running_lock);
+	running = false;
+	pthread_mutex_unlock(&running_lock);
+	for (int i = 0; i < threads; ++i)
+		pthread_join(workers[i].thread, NULL);
+	for (int i = 0; i < boards; ++i) {
+		if (board_states[i].device != NULL)
+			k8055_close_device(board_states[i].device);
+		pthread_rwlock_destroy(&board_states[i].lock);
+	}
+	if (idle != NULL)
+		k8055_close_device(idle);
+
+	long operations = 0, errors = 0, mismatches = 0;
+	puts("");
+	puts("thread  operations  ops/s  errors  reopens  mismatches  recovery mean/max [ms]");
+	for (int i = 0; i < threads; ++i) {
+		struct worker* w = &workers[i];
+		printf("%6d %11ld %6.0f %7ld %8ld %11ld  %8.3f / %.3f\n", i, w->operations,
+				w->operations / elapsed, w->errors, w->reopens, w->mismatches,
+				w->recoveries > 0 ? w->recovery_total / w->recoveries : 0.0, w->recovery_max);
+		operations += w->operations;
+		errors += w->errors;
+		mismatches += w->mismatches;
+	}
+	printf("\nthroughput: %.0f operations/s, %ld errors, %ld injected faults, %ld transfers\n",
+			operations / elapsed, errors, end_stats.faults - start_stats.faults,
+			end_stats.transfers - start_stats.transfers);
+	printf("allocations: %d -> %d, open handles: %d -> %d, file descriptors: %d -> %d, resident memory: %ld -> %ld kB\n",
+			start_stats.allocations, end_stats.allocations, start_stats.handles, end_stats.handles,
+			start_fds, end_fds, start_rss, end_rss);
+
+	struct sim_stats final_stats;
+	sim_get_stats(&final_stats);
+	if (mismatches != 0 || final_stats.allocations != 0 || final_stats.handles != 0) {
+		printf("FAILED: %ld mismatches, %d allocations and %d handles left after closing all boards\n",
+				mismatches, final_stats.allocations, final_stats.handles);
+		return -1;
+	}
+	puts("success");
+	return 0;
+}
@@ -1,7 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
 #include "k8055.h"
+#ifdef K8055_SIM
+#include <pthread.h>
+#include "sim.h"
+
+#define TRACE_LENGTH 256 /* trace events kept per device, see k8055_read_trace() */
+#define TRACE_OVERFLOW 300 /* events recorded by test_trace() without reading the trace */
+#define TRACE_RETRIES 3 /* tries of a failed write */
+
+static const char* trace_file = NULL; /* file test_trace() writes its events to, if set */
+static const char* trace_decoder = NULL; /* k8055-tracedump, run on trace_file if set */
+#endif
 
 static int port = 0;
 
@@ -21,6 +33,24 @@ int test_all_digital(k8055_device* device) {
 	return 0;
 }
 
+int test_sequence(k8055_device* device) {
+	struct k8055_output states[256];
+	int status[256];
+	for (int i = 0; i < 256; ++i) {
+		states[i].digital = i;
+		states[i].analog0 = i;
+		states[i].analog1 = 255 - i;
+	}
+	if (k8055_write_sequence(device, states, 256, status, 0) != 0) return -1;
+	for (int i = 0; i < 256; ++i)
+		if (status[i] != 0) return -1;
+
+	int d, a0, a1;
+	k8055_get_all_output(device, &d, &a0, &a1, NULL, NULL);
+	if (d != 255 || a0 != 255 || a1 != 0) return -1;
+	return 0;
+}
+
 int test_analog(k8055_device* device) {
 	struct timespec reqtime;
         reqtime.tv_sec = 0;
@@ -55,6 +85,483 @@ int test_get_all_input(k8055_device* device) {
 	return 0;
 }
 
+int test_poll(k8055_device* device) {
+	if (k8055_set_poll_interval(device, 0, 100) != K8055_ERROR_INDEX) return -1;
+	if (k8055_set_poll_interval(device, 20, 10) != K8055_ERROR_INDEX) return -1;
+	if (k8055_set_poll_interval(device, 10, 40) != 0) return -1;
+
+	for (int i = 0; i < 4; ++i) {
+		if (k8055_poll(device, NULL, NULL, NULL, NULL, NULL) < 0) return -1;
+		int interval = k8055_get_poll_interval(device);
+		if (interval < 10 || interval > 40) return -1;
+		if (k8055_poll_timeout(device) > interval) return -1;
+	}
+	return 0;
+}
+
+int test_window(k8055_device* device) {
+	struct timespec reqtime;
+	reqtime.tv_sec = 0;
+	reqtime.tv_nsec = 5000000;
+
+	if (k8055_add_window(device, 100, 30) != K8055_ERROR_INDEX) return -1;
+	int window = k8055_add_window(device, 20, 10);
+	if (window < 0) return -1;
+
+	struct k8055_window aggregate;
+	int completed = 0;
+	for (int i = 0; i < 10; ++i) {
+		if (k8055_get_all_input(device, NULL, NULL, NULL, NULL, NULL, true) != 0) return -1;
+		if (k8055_read_window(device, window, &aggregate) == 1) {
+			if (aggregate.samples > 0 && aggregate.analog_min[0] > aggregate.analog_max[0]) return -1;
+			completed += 1;
+		}
+		nanosleep(&reqtime, NULL);
+	}
+	if (completed == 0) return -1;
+	return 0;
+}
+
+#ifdef K8055_SIM
+/* tests relying on the simulated board, see sim/sim.h */
+
+int test_sequence_interval(k8055_device* device) {
+	struct sim_config saved, config;
+	sim_get_config(&saved);
+	config = saved;
+	config.interval = 10000; /* the real board's 10 ms interrupt interval */
+	sim_configure(&config);
+
+	struct k8055_output states[16];
+	int status[16];
+	for (int i = 0; i < 16; ++i) {
+		states[i].digital = i;
+		states[i].analog0 = i * 16;
+		states[i].analog1 = 255 - i * 16;
+	}
+	int r = k8055_write_sequence(device, states, 16, status, 0);
+	sim_configure(&saved);
+	if (r != 0) return -1;
+	for (int i = 0; i < 16; ++i)
+		if (status[i] != 0) return -1;
+
+	int d, a0, a1;
+	k8055_get_all_output(device, &d, &a0, &a1, NULL, NULL);
+	if (d != 15 || a0 != 240 || a1 != 15) return -1;
+	return 0;
+}
+
+/** Checks a trace event against the expected transfer. */
+static int check_event(const struct k8055_trace_event* event, uint32_t sequence, int type, int command,
+		int attempt, int status) {
+	if (event->sequence != sequence || event->type != type || event->command != command) return -1;
+	if (event->attempt != attempt || event->status != status) return -1;
+	if (event->length != (status == 0 ? 8 : 0)) return -1;
+	return 0;
+}
+
+/** Runs a check on a freshly opened board on another port than the one under test. */
+static int run_on_board(int (*check)(k8055_device*)) {
+	k8055_device* board = NULL;
+	if (k8055_open_device((port + 1) % 4, &board) != 0) return -1;
+	int r = check(board);
+	k8055_close_device(board);
+	return r;
+}
+
+/** Runs the trace decoder on the trace file and checks the numbers of events, failures and lost events
+ * in its summary. */
+static int check_decoded_trace(int events, int failed, int lost) {
+	char command[1024];
+	snprintf(command, sizeof(command), "%s %s", trace_decoder, trace_file);
+	FILE* decoder = popen(command, "r");
+	if (decoder == NULL) return -1;
+	char line[256];
+	long decoded = -1, decoded_failed = -1, decoded_slow = -1, decoded_lost = -1;
+	double slow;
+	while (fgets(line, sizeof(line), decoder) != NULL) /* the summary is the last line */
+		sscanf(line, "%ld events, %ld failed, %ld slow (>= %lf ms), %ld lost", &decoded, &decoded_failed,
+				&decoded_slow, &slow, &decoded_lost);
+	if (pclose(decoder) != 0) return -1;
+	if (decoded != events || decoded_failed != failed || decoded_lost != lost) return -1;
+	return 0;
+}
+
+/** Traces a known mix of writes, reads and failed retries, then more events than the trace holds.
+ * The events read are written to trace_file and decoded with trace_decoder, if they are set. */
+static int check_trace(k8055_device* board) {
+	struct k8055_trace_event events[2 * TRACE_LENGTH];
+	int length = 2 * TRACE_LENGTH;
+	while (k8055_read_trace(board, events, length) > 0); /* events of opening the board */
+
+	if (k8055_set_digital(board, 0, true) != 0) return -1;
+	if (k8055_get_all_input(board, NULL, NULL, NULL, NULL, NULL, false) != 0) return -1;
+	if (k8055_reset_counter(board, 1) != 0) return -1;
+
+	struct sim_config saved, config;
+	sim_get_config(&saved);
+	config = saved;
+	config.timeout_rate = 1.0;
+	sim_configure(&config);
+	int r = k8055_set_analog(board, 0, 10);
+	sim_configure(&saved);
+	if (r != K8055_ERROR_WRITE) return -1;
+
+	int n = k8055_read_trace(board, events, length);
+	if (n != 4 + TRACE_RETRIES) return -1;
+	uint32_t first = events[0].sequence;
+	if (check_event(&events[0], first, K8055_TRACE_WRITE, 5, 0, 0) != 0) return -1;
+	if (check_event(&events[1], first + 1, K8055_TRACE_READ, 0, 0, 0) != 0) return -1;
+	if (check_event(&events[2], first + 2, K8055_TRACE_READ, 0, 0, 0) != 0) return -1;
+	if (check_event(&events[3], first + 3, K8055_TRACE_WRITE, 4, 0, 0) != 0) return -1;
+	for (int i = 0; i < TRACE_RETRIES; ++i) /* every retry of the write timed out */
+		if (check_event(&events[4 + i], first + 4 + i, K8055_TRACE_WRITE, 5, i, -7) != 0) return -1;
+
+	/* overflow the trace, the oldest events are lost */
+	int lost = TRACE_OVERFLOW - TRACE_LENGTH;
+	for (int i = 0; i < TRACE_OVERFLOW; ++i)
+		if (k8055_set_all_digital(board, i & 0xff) != 0) return -1;
+	int m = k8055_read_trace(board, events + n, length - n);
+	if (m != TRACE_LENGTH) return -1;
+	if (events[n].sequence != first + n + lost) return -1;
+	for (int i = 1; i < m; ++i)
+		if (events[n + i].sequence != events[n + i - 1].sequence + 1) return -1;
+
+	if (trace_file == NULL)
+		return 0;
+	FILE* file = fopen(trace_file, "wb");
+	if (file == NULL) return -1;
+	size_t written = fwrite(events, sizeof(events[0]), n + m, file);
+	fclose(file);
+	if (written != (size_t) (n + m)) return -1;
+	if (trace_decoder == NULL)
+		return 0;
+	return check_decoded_trace(n + m, TRACE_RETRIES, lost);
+}
+
+int test_trace(k8055_device* device) {
+	return run_on_board(check_trace);
+}
+
+/** Checks that a write sequence to a device that must be reopened reports every state as not written. */
+static int check_sequence_closed(k8055_device* board) {
+	struct k8055_output states[4] = {{0}};
+	int status[4] = {1, 1, 1, 1};
+	if (k8055_write_sequence(board, states, 4, status, 0) != K8055_ERROR_CLOSED) return -1;
+	for (int i = 0; i < 4; ++i)
+		if (status[i] != K8055_ERROR_CLOSED) return -1;
+	return 0;
+}
+
+/** Makes event handling fail until a transfer is lost while running the given operation, then checks
+ * that the board must be reopened and that closing it drains the lost transfers. */
+static int check_lost_transfer(int (*operation)(k8055_device*)) {
+	struct sim_stats before, after;
+	sim_get_stats(&before);
+	k8055_device* board = NULL;
+	if (k8055_open_device((port + 1) % 4, &board) != 0) return -1;
+
+	sim_fail_events(2); /* the transfer cannot be given back after it is cancelled */
+	int r = operation(board);
+	sim_fail_events(0);
+	if (r != K8055_ERROR_CLOSED) r = -1;
+	else if (k8055_set_all_digital(board, 0) != K8055_ERROR_CLOSED) r = -1;
+	else if (k8055_get_all_input(board, NULL, NULL, NULL, NULL, NULL, false) != K8055_ERROR_CLOSED) r = -1;
+	else if (k8055_reset_counter(board, 0) != K8055_ERROR_CLOSED) r = -1;
+	else r = check_sequence_closed(board);
+	k8055_close_device(board);
+
+	sim_get_stats(&after);
+	if (after.allocations != before.allocations || after.handles != before.handles) return -1;
+	if (after.freed_in_flight != before.freed_in_flight) return -1;
+
+	if (k8055_open_device((port + 1) % 4, &board) != 0) return -1;
+	if (k8055_set_all_digital(board, 0x01) != 0) r = -1;
+	k8055_close_device(board);
+	return r;
+}
+
+static int write_digital(k8055_device* board) {
+	return k8055_set_all_digital(board, 0x01);
+}
+
+static int write_sequence(k8055_device* board) {
+	struct k8055_output states[8] = {{0}};
+	return k8055_write_sequence(board, states, 8, NULL, 0);
+}
+
+int test_lost_transfer(k8055_device* device) {
+	if (check_lost_transfer(write_digital) != 0) return -1;
+	if (check_lost_transfer(write_sequence) != 0) return -1;
+	return 0;
+}
+
+/** Polls the device once and checks whether a change was reported and the resulting interval. */
+static int check_poll(k8055_device* device, int changed, int interval) {
+	if (k8055_poll(device, NULL, NULL, NULL, NULL, NULL) != changed) return -1;
+	if (k8055_get_poll_interval(device) != interval) return -1;
+	return 0;
+}
+
+int test_poll_loopback(k8055_device* device) {
+	if (k8055_set_poll_deadband(device, 256) != K8055_ERROR_INDEX) return -1;
+	if (k8055_set_poll_interval(device, 10, 80) != 0) return -1;
+	if (k8055_set_all_analog(device, 100, 100) != 0) return -1;
+	if (k8055_set_all_digital(device, 0x01) != 0) return -1;
+	if (check_poll(device, 1, 10) != 0) return -1;
+
+	/* jitter of the analog inputs within the deadband, the interval backs off */
+	if (k8055_set_all_analog(device, 101, 99) != 0) return -1;
+	if (check_poll(device, 0, 20) != 0) return -1;
+	if (k8055_set_all_analog(device, 100, 100) != 0) return -1;
+	if (check_poll(device, 0, 40) != 0) return -1;
+	if (k8055_set_all_analog(device, 101, 100) != 0) return -1;
+	if (check_poll(device, 0, 80) != 0) return -1;
+	if (check_poll(device, 0, 80) != 0) return -1;
+
+	/* a digital input (looped back from output 2) changes */
+	if (k8055_set_all_digital(device, 0x03) != 0) return -1;
+	if (check_poll(device, 1, 10) != 0) return -1;
+	if (check_poll(device, 0, 20) != 0) return -1;
+
+	/* an analog input leaves the deadband */
+	if (k8055_set_all_analog(device, 110, 100) != 0) return -1;
+	if (check_poll(device, 1, 10) != 0) return -1;
+
+	/* without deadband, jitter counts as a change */
+	if (k8055_set_poll_deadband(device, 0) != 0) return -1;
+	if (k8055_set_all_analog(device, 111, 100) != 0) return -1;
+	if (check_poll(device, 1, 10) != 0) return -1;
+	if (k8055_set_poll_deadband(device, 1) != 0) return -1;
+	return 0;
+}
+
+static double now_ms(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+/** Thread sharing a board with the test. */
+struct sharer {
+	k8055_device* device;
+	bool output; /* writes outputs, reads inputs otherwise */
+	bool once;
+	int errors;
+};
+
+static bool sharing = false;
+static pthread_mutex_t sharing_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool is_sharing(void) {
+	pthread_mutex_lock(&sharing_lock);
+	bool r = sharing;
+	pthread_mutex_unlock(&sharing_lock);
+	return r;
+}
+
+static void set_sharing(bool value) {
+	pthread_mutex_lock(&sharing_lock);
+	sharing = value;
+	pthread_mutex_unlock(&sharing_lock);
+}
+
+/** Writes outputs or reads inputs once, or else as fast as possible while sharing is set, for at most 2 s. */
+static void* run_sharer(void* arg) {
+	struct sharer* s = (struct sharer*) arg;
+	double start = now_ms();
+	do {
+		int r;
+		if (s->output)
+			r = k8055_set_all_digital(s->device, 0x02);
+		else
+			r = k8055_get_all_input(s->device, NULL, NULL, NULL, NULL, NULL, false);
+		if (r != 0)
+			s->errors += 1;
+	} while (!s->once && is_sharing() && now_ms() - start < 2000);
+	return NULL;
+}
+
+int test_preempt_read(k8055_device* device) {
+	struct timespec reqtime;
+	reqtime.tv_sec = 0;
+	reqtime.tv_nsec = 3000000;
+
+	struct sim_config saved, config;
+	sim_get_config(&saved);
+	config = saved;
+	config.latency = 10000; /* the write is issued while the read's first packet is in flight */
+	sim_configure(&config);
+
+	struct k8055_trace_event events[64];
+	while (k8055_read_trace(device, events, 64) > 0);
+
+	struct sharer reader = {device, false, true, 0};
+	pthread_t thread;
+	pthread_create(&thread, NULL, run_sharer, &reader);
+	nanosleep(&reqtime, NULL);
+	int r = k8055_set_digital(device, 2, true);
+	pthread_join(thread, NULL);
+	sim_configure(&saved);
+	if (r != 0 || reader.errors != 0) return -1;
+
+	/* the write goes between the two packets of the read */
+	int n = k8055_read_trace(device, events, 64);
+	if (n != 3) return -1;
+	if (events[0].type != K8055_TRACE_READ || events[1].type != K8055_TRACE_WRITE
+			|| events[2].type != K8055_TRACE_READ) return -1;
+	return 0;
+}
+
+int test_counter_starvation(k8055_device* device) {
+	/* two writers, so that an output is always waiting, and a poller */
+	struct sharer sharers[3] = {{device, true, false, 0}, {device, true, false, 0}, {device, false, false, 0}};
+	pthread_t threads[3];
+	set_sharing(true);
+	for (int i = 0; i < 3; ++i)
+		pthread_create(&threads[i], NULL, run_sharer, &sharers[i]);
+
+	/* counter resets rank between outputs and reads, and must get through while both compete */
+	double start = now_ms();
+	int errors = 0;
+	for (int i = 0; i < 20; ++i)
+		if (k8055_reset_counter(device, i % 2) != 0)
+			errors += 1;
+	double elapsed = now_ms() - start;
+
+	set_sharing(false);
+	for (int i = 0; i < 3; ++i) {
+		pthread_join(threads[i], NULL);
+		errors += sharers[i].errors;
+	}
+	if (errors != 0) return -1;
+	if (elapsed > 500) return -1;
+	return 0;
+}
+
+/** Toggles digital output 1, wired back to the input of counter 1, and reads the inputs after every change. */
+static int toggle_counter(k8055_device* device, int times) {
+	for (int i = 0; i < times; ++i) {
+		if (k8055_set_digital(device, 0, true) != 0) return -1;
+		if (k8055_get_all_input(device, NULL, NULL, NULL, NULL, NULL, false) != 0) return -1;
+		if (k8055_set_digital(device, 0, false) != 0) return -1;
+		if (k8055_get_all_input(device, NULL, NULL, NULL, NULL, NULL, false) != 0) return -1;
+	}
+	return 0;
+}
+
+/** Reads the inputs every 5 ms until the given window completes, for at most 100 ms. */
+static int wait_window(k8055_device* board, int window, struct k8055_window* aggregate) {
+	struct timespec reqtime;
+	reqtime.tv_sec = 0;
+	reqtime.tv_nsec = 5000000;
+
+	for (int i = 0; i < 20; ++i) {
+		nanosleep(&reqtime, NULL);
+		if (k8055_get_all_input(board, NULL, NULL, NULL, NULL, NULL, false) != 0) return -1;
+		int r = k8055_read_window(board, window, aggregate);
+		if (r != 0)
+			return r == 1 ? 0 : -1;
+	}
+	return -1;
+}
+
+/** Counts and analog values read before a window is added must not show up in it. Runs on a
+ * freshly opened board on another port, so that no window exists before the test adds one. */
+static int check_window_loopback(k8055_device* board) {
+	if (k8055_set_all_analog(board, 100, 200) != 0) return -1;
+	if (toggle_counter(board, 10) != 0) return -1; /* counted before the window exists */
+
+	int window = k8055_add_window(board, 40, 40);
+	if (window < 0) return -1;
+	if (toggle_counter(board, 3) != 0) return -1;
+
+	struct k8055_window aggregate;
+	if (wait_window(board, window, &aggregate) != 0) return -1;
+	if (aggregate.counter_delta[0] != 3 || aggregate.counter_delta[1] != 0) return -1;
+	if (aggregate.analog_mean[0] != 100.0 || aggregate.analog_mean[1] != 200.0) return -1;
+	if (aggregate.analog_min[0] != 100 || aggregate.analog_max[1] != 200) return -1;
+	if (!(aggregate.digital_on & 0x01)) return -1;
+	return 0;
+}
+
+int test_window_loopback(k8055_device* device) {
+	return run_on_board(check_window_loopback);
+}
+
+/** A reset counter counts from zero in the window, although the firmware first returns the packet
+ * buffered before the reset. */
+static int check_window_reset(k8055_device* board) {
+	int window = k8055_add_window(board, 40, 40);
+	if (window < 0) return -1;
+	if (toggle_counter(board, 5) != 0) return -1;
+	if (k8055_reset_counter(board, 0) != 0) return -1;
+	for (int i = 0; i < 2; ++i)
+		if (k8055_get_all_input(board, NULL, NULL, NULL, NULL, NULL, true) != 0) return -1;
+	if (toggle_counter(board, 2) != 0) return -1;
+
+	struct k8055_window aggregate;
+	if (wait_window(board, window, &aggregate) != 0) return -1;
+	if (aggregate.counter_delta[0] != 7) return -1;
+	return 0;
+}
+
+int test_window_reset(k8055_device* device) {
+	return run_on_board(check_window_reset);
+}
+
+/** Reads that stop for longer than a window, as polls do once they have backed off, must not lose
+ * the window read before the gap to the empty windows completed after it. */
+static int check_window_gap(k8055_device* board) {
+	struct timespec reqtime;
+	reqtime.tv_sec = 0;
+	reqtime.tv_nsec = 50000000;
+
+	int window = k8055_add_window(board, 20, 20);
+	if (window < 0) return -1;
+	for (int i = 0; i < 3; ++i)
+		if (k8055_get_all_input(board, NULL, NULL, NULL, NULL, NULL, false) != 0) return -1;
+	nanosleep(&reqtime, NULL);
+	if (k8055_get_all_input(board, NULL, NULL, NULL, NULL, NULL, false) != 0) return -1;
+
+	struct k8055_window aggregate;
+	if (k8055_read_window(board, window, &aggregate) != 1) return -1;
+	if (aggregate.samples != 3 || aggregate.dropped < 1) return -1;
+	return 0;
+}
+
+/** A window without reads reports zero analog statistics, not those of an earlier window. */
+static int check_window_empty(k8055_device* board) {
+	struct timespec reqtime;
+	reqtime.tv_sec = 0;
+	reqtime.tv_nsec = 30000000;
+
+	if (k8055_set_all_analog(board, 100, 200) != 0) return -1;
+	if (k8055_get_all_input(board, NULL, NULL, NULL, NULL, NULL, false) != 0) return -1;
+	int window = k8055_add_window(board, 10, 10);
+	if (window < 0) return -1;
+	nanosleep(&reqtime, NULL); /* the first window passes without reads */
+	if (k8055_get_all_input(board, NULL, NULL, NULL, NULL, NULL, false) != 0) return -1;
+
+	struct k8055_window aggregate;
+	if (k8055_read_window(board, window, &aggregate) != 1) return -1;
+	if (aggregate.samples != 0) return -1;
+	for (int i = 0; i < 2; ++i) {
+		if (aggregate.analog_min[i] != 0 || aggregate.analog_max[i] != 0) return -1;
+		if (aggregate.analog_mean[i] != 0.0 || aggregate.analog_stddev[i] != 0.0) return -1;
+	}
+	return 0;
+}
+
+int test_window_empty(k8055_device* device) {
+	return run_on_board(check_window_empty);
+}
+
+int test_window_gap(k8055_device* device) {
+	return run_on_board(check_window_gap);
+}
+#endif
+
 int test_get_all_output(k8055_device* device) {
 	unsigned int iseed = (unsigned int)time(NULL);
 	srand(iseed);
@@ -89,24 +596,55 @@ int run_all() {
 	k8055_debug(true);
 	k8055_device* device = NULL;
 	
-	size_t n = 6;
 	char* names[] = {
 		"= write all analog =",
 		"= write all digital =",
+		"= write sequence =",
 		"= write analog =",
 		"= write digital =",
 		"= read input =",
+		"= poll input =",
+		"= aggregate input =",
+#ifdef K8055_SIM
+		"= write sequence at the board's interval =",
+		"= aggregate loopback input =",
+		"= aggregate input across a counter reset =",
+		"= aggregate input after a gap =",
+		"= aggregate without input =",
+		"= poll loopback input =",
+		"= trace transfers =",
+		"= lost transfers =",
+		"= output preempting a read =",
+		"= counter resets among outputs and reads =",
+#endif
 		"= read output ="
 	};
 	
 	int (*tests[])(k8055_device*) = {
 		test_all_analog,
 		test_all_digital,
+		test_sequence,
 		test_analog,
 		test_digital,
 		test_get_all_input,
+		test_poll,
+		test_window,
+#ifdef K8055_SIM
+		test_sequence_interval,
+		test_window_loopback,
+		test_window_reset,
+		test_window_gap,
+		test_window_empty,
+		test_poll_loopback,
+		test_trace,
+		test_lost_transfer,
+		test_preempt_read,
+		test_counter_starvation,
+#endif
 		test_get_all_output
 	};
+	size_t n = sizeof(tests) / sizeof(tests[0]);
+	int failed = 0;
 	
 
 
@@ -121,7 +659,8 @@ int run_all() {
 	}
 
 	for (int j = 0; j < n; ++j)
-		run_test(names[j], tests[j], device);
+		if (run_test(names[j], tests[j], device) != 0)
+			failed += 1;
 
 	printf("= reopen k8055 on port %i =\n", port);
 	k8055_close_device(device);
@@ -135,7 +674,8 @@ int run_all() {
 	}
 
 	for (int j = 0; j < n; ++j)
-		run_test(names[j], tests[j], device);
+		if (run_test(names[j], tests[j], device) != 0)
+			failed += 1;
 
 	
 	puts("turning everything off");
@@ -143,12 +683,24 @@ int run_all() {
 	k8055_set_all_digital(device, 0);
 	k8055_close_device(device);
 
-	return 0;	
+	return failed == 0 ? 0 : -1;
 }
 
 int main(int argc, char *argv[]) {
-	if (argc <= 1) port = 0;
-	else port = atoi(argv[1]);
+#ifdef K8055_SIM
+	int c;
+	while ((c = getopt(argc, argv, "t:d:")) != -1) {
+		switch (c) {
+		case 't': trace_file = optarg; break;
+		case 'd': trace_decoder = optarg; break;
+		default:
+			puts("usage: k8055-test-sim [-t trace file [-d trace decoder]] [port]");
+			return -1;
+		}
+	}
+#endif
+	if (argc <= optind) port = 0;
+	else port = atoi(argv[optind]);
 
 	int r = run_all();
 	puts("");
@@ -0,0 +1,103 @@
+/* Prints a timeline of k8055 trace events.
+
+ The input is a binary file of struct k8055_trace_event, as written by an application with
+ fwrite() from the events returned by k8055_read_trace(). Every event is printed on one line with
+ its time relative to the first event, failed transfers are marked with their error and transfers
+ slower than a threshold are flagged, so that intermittent latency spikes can be located.
+
+ usage: k8055-tracedump <trace file> [slow threshold in ms, default 10]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "k8055.h"
+
+/** Returns a name for a libusb error code (see libusb.h). */
+static const char* status_name(int status) {
+	switch (status) {
+	case 0: return "ok";
+	case -1: return "io error";
+	case -4: return "no device";
+	case -6: return "busy";
+	case -7: return "timeout";
+	case -8: return "overflow";
+	case -9: return "stall";
+	default: return "error";
+	}
+}
+
+static const char* command_name(int command) {
+	switch (command) {
+	case 0: return "reset";
+	case 1: return "debounce 1";
+	case 2: return "debounce 2";
+	case 3: return "reset counter 1";
+	case 4: return "reset counter 2";
+	case 5: return "set analog/digital";
+	default: return "unknown";
+	}
+}
+
+int main(int argc, char *argv[]) {
+	if (argc <= 1) {
+		puts("usage: k8055-tracedump <trace file> [slow threshold in ms]");
+		return -1;
+	}
+	FILE* file = fopen(argv[1], "rb");
+	if (file == NULL) {
+		printf("could not open %s\n", argv[1]);
+		return -1;
+	}
+	double slow = 10.0;
+	if (argc > 2)
+		slow = atof(argv[2]);
+
+	struct k8055_trace_event event;
+	uint64_t start = 0;
+	uint32_t next = 0;
+	long events = 0, failed = 0, slow_events = 0, lost = 0;
+	double max_latency = 0;
+
+	puts("    time [ms]  latency [ms]  event");
+	while (fread(&event, sizeof(event), 1, file) == 1) {
+		if (events == 0) {
+			start = event.time;
+			next = event.sequence;
+		}
+		if (event.sequence != next) { /* events overwritten before they were read */
+			printf("             ...           %u events lost\n", event.sequence - next);
+			lost += event.sequence - next;
+		}
+		next = event.sequence + 1;
+
+		double time = (event.time - start) / 1000.0;
+		double latency = event.latency / 1000.0;
+		if (event.type == K8055_TRACE_WRITE)
+			printf("%13.3f %13.3f  write %s", time, latency, command_name(event.command));
+		else
+			printf("%13.3f %13.3f  read", time, latency);
+		if (event.attempt > 0)
+			printf(", retry %d", event.attempt);
+		if (event.status != 0) {
+			printf(", %s", status_name(event.status));
+			failed += 1;
+		} else if (event.length != 8) {
+			printf(", short (%d bytes)", event.length);
+			failed += 1;
+		}
+		if (latency >= slow) {
+			printf("  <-- SLOW");
+			slow_events += 1;
+		}
+		puts("");
+
+		if (latency > max_latency)
+			max_latency = latency;
+		events += 1;
+	}
+	fclose(file);
+
+	printf("\n%ld events, %ld failed, %ld slow (>= %.3f ms), %ld lost, maximum latency %.3f ms\n",
+			events, failed, slow_events, slow, lost, max_latency);
+	return 0;
+}